@@ -0,0 +1,52 @@
+#include <avr/pgmspace.h>
+
+#include "adpcm.h"
+
+static const uint16_t adpcm_steps[89] PROGMEM = {
+    7, 8, 9, 10, 11, 12, 13, 14, 16, 17, 19, 21, 23, 25, 28, 31, 34, 37,
+    41, 45, 50, 55, 60, 66, 73, 80, 88, 97, 107, 118, 130, 143, 157, 173,
+    190, 209, 230, 253, 279, 307, 337, 371, 408, 449, 494, 544, 598, 658,
+    724, 796, 876, 963, 1060, 1166, 1282, 1411, 1552, 1707, 1878, 2066,
+    2272, 2499, 2749, 3024, 3327, 3660, 4026, 4428, 4871, 5358, 5894,
+    6484, 7132, 7845, 8630, 9493, 10442, 11487, 12635, 13899, 15289,
+    16818, 18500, 20350, 22385, 24623, 27086, 29794, 32767,
+};
+
+/* step index change for the magnitude bits */
+static const int8_t adpcm_index[8] PROGMEM = {
+    -1, -1, -1, -1, 2, 4, 6, 8,
+};
+
+/*
+ * The predictor is kept in offset binary, so clamping stays within
+ * unsigned 16-bit arithmetic and the DAC value is its high byte.
+ */
+uint8_t adpcm_decode(adpcm_state_t *state, uint8_t nibble)
+{
+    uint16_t step = pgm_read_word(&adpcm_steps[state->index]);
+    int8_t index = state->index +
+        (int8_t) pgm_read_byte(&adpcm_index[nibble & 7]);
+    uint16_t diff = step >> 3;
+    uint16_t level = state->level;
+
+    if (nibble & 4)
+        diff += step;
+    if (nibble & 2)
+        diff += step >> 1;
+    if (nibble & 1)
+        diff += step >> 2;
+
+    if (index < 0)
+        index = 0;
+    else if (index > 88)
+        index = 88;
+    state->index = index;
+
+    if (nibble & 8)
+        level = diff > level ? 0 : level - diff;
+    else
+        level = diff > 0xffff - level ? 0xffff : level + diff;
+    state->level = level;
+
+    return level >> 8;
+}
@@ -0,0 +1,22 @@
+#ifndef DISCONNECT_ADPCM_H
+#define DISCONNECT_ADPCM_H
+#include <stdint.h>
+
+/*
+ * IMA (DVI) ADPCM decoder, 4 bits per sample, the format of Python's
+ * audioop.lin2adpcm(): first sample in the high nibble, both sides
+ * start from a zero predictor and step index 0 (ADPCM_STATE_INIT).
+ */
+typedef struct {
+    uint16_t level;     /* predictor + 0x8000, offset binary like the DAC */
+    uint8_t index;
+} adpcm_state_t;
+
+#define ADPCM_STATE_INIT {0x8000, 0}
+
+/**
+ * Decode one nibble, returns the sample as an unsigned 8-bit DAC value.
+ */
+uint8_t adpcm_decode(adpcm_state_t *state, uint8_t nibble);
+
+#endif /* DISCONNECT_ADPCM_H */
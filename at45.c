@@ -1,30 +1,54 @@
 #include <util/delay.h>
+#include <avr/pgmspace.h>
 
 #include "at45.h"
 #include "irq.h"
 #include "uart.h"
 
 #define OP_READ_STATUS          0xd7
+#define OP_READ_ID              0x9f
 #define OP_READ_CONTINUOUS      0xe8
-#define OP_READ_CONTINUOUS_33   0x03
+#define OP_READ_CONTINUOUS_33   AT45_OP_READ
 
 /* write to buffer, then write-erase to flash */
 #define OP_PROGRAM_VIA_BUF1     0x82
 #define OP_PROGRAM_VIA_BUF2     0x85
 
-#define PAGE_OFFSET 11
+#define OP_DEEP_POWER_DOWN      0xb9
+#define OP_RESUME               0xab
 
-static inline
-void at45_select()
-{
-    PORTE &= ~(1 << PE5);
-}
+/* buffer only, then separate program */
+#define OP_BUF1_WRITE           0x84
+#define OP_BUF1_TO_PAGE_ERASE   0x83
+#define OP_BUF2_WRITE           0x87
+#define OP_BUF2_TO_PAGE_ERASE   0x86
 
-static inline
-void at45_deselect()
-{
-    PORTE |= (1 << PE5);
-}
+/* main memory page to buffer */
+#define OP_PAGE_TO_BUF1         0x53
+#define OP_PAGE_TO_BUF2         0x55
+
+/* status register */
+#define STATUS_READY            0x80
+#define STATUS_BINARY_PAGES     0x01
+
+typedef struct {
+    uint8_t  device_id;
+    uint8_t  page_shift;    /* DataFlash page mode */
+    uint16_t page_size;
+    uint16_t nr_pages;
+} at45_part_t;
+
+/* Binary page mode uses page_size rounded down to power of two */
+static const at45_part_t at45_parts[] PROGMEM = {
+    {0x26, 10,  528, 4096}, /* AT45DB161 */
+    {0x27, 10,  528, 8192}, /* AT45DB321 */
+    {0x28, 11, 1056, 8192}, /* AT45DB642 */
+};
+
+#define NR_PARTS (sizeof(at45_parts) / sizeof(at45_parts[0]))
+
+at45_geometry_t at45_geometry;
+unsigned char at45_asleep;
 
 static inline
 unsigned char at45_status_read()
@@ -39,29 +63,37 @@ unsigned char at45_status_read()
     return b;
 }
 
+static inline
+void at45_send_addr24(uint32_t addr)
+{
+    at45_spi_write(addr >> 16);
+    at45_spi_write(addr >> 8);
+    at45_spi_write(addr & 0xff);
+}
+
+static inline
+void at45_send_addr(unsigned int page, unsigned int offset)
+{
+    at45_send_addr24(((uint32_t) page << at45_geometry.page_shift) | offset);
+}
+
 int at45_write_page(unsigned int page, const char *data)
 {
-    unsigned int addr;
     unsigned char status;
-    int i;
+    unsigned int i;
 
-    if (page >= AT45_NR_PAGES)
+    if (page >= at45_geometry.nr_pages)
         return -1;
 
     status = at45_status_read();
     uart0_print_hex(status);
     uart0_puts("\r\n");
 
-
-    addr = page << (PAGE_OFFSET - 8);
-
     at45_select();
     at45_spi_write(OP_PROGRAM_VIA_BUF1);
-    at45_spi_write(addr >> 8);
-    at45_spi_write(addr & 0xff);
-    at45_spi_write(0);
+    at45_send_addr(page, 0);
 
-    for (i = 0; i < AT45_PAGE_SIZE; i++)
+    for (i = 0; i < at45_geometry.page_size; i++)
         at45_spi_write(data[i]);
 
     at45_deselect();
@@ -70,25 +102,23 @@ int at45_write_page(unsigned int page, const char *data)
 
     do {
         status = at45_status_read();
-    } while (0 == (status & 0x80));
+    } while (0 == (status & STATUS_READY));
 
     return 0;
 }
 
+static unsigned int at45_write_page_no;
+
 int at45_write_page_start(unsigned int page)
 {
-    unsigned int addr;
-
-    if (page >= AT45_NR_PAGES)
+    if (page >= at45_geometry.nr_pages)
         return -1;
 
-    addr = page << (PAGE_OFFSET - 8);
+    at45_write_page_no = page;
 
     at45_select();
-    at45_spi_write(OP_PROGRAM_VIA_BUF1);
-    at45_spi_write(addr >> 8);
-    at45_spi_write(addr & 0xff);
-    at45_spi_write(0);
+    at45_spi_write(OP_BUF1_WRITE);
+    at45_send_addr(0, 0);
 
     return 0;
 }
@@ -97,26 +127,86 @@ int at45_write_page_stop()
 {
     at45_deselect();
 
-    while (0 == (at45_status_read() & 0x80))
+    at45_select();
+    at45_spi_write(OP_BUF1_TO_PAGE_ERASE);
+    at45_send_addr(at45_write_page_no, 0);
+    at45_deselect();
+
+    while (0 == (at45_status_read() & STATUS_READY))
         ;
 
     return 0;
 }
 
-int at45_read_start(unsigned int page)
+void at45_write_page_abort()
+{
+    at45_deselect();
+}
+
+int at45_busy()
+{
+    return !(at45_status_read() & STATUS_READY);
+}
+
+void at45_wait_ready()
+{
+    while (at45_busy())
+        ;
+}
+
+void at45_buffer_write(uint8_t buf, unsigned int offset,
+                       const uint8_t *data, unsigned int len)
+{
+    at45_select();
+    at45_spi_write(buf ? OP_BUF2_WRITE : OP_BUF1_WRITE);
+    at45_send_addr(0, offset);
+    while (len--)
+        at45_spi_write(*data++);
+    at45_deselect();
+}
+
+void at45_buffer_program(uint8_t buf, unsigned int page)
+{
+    at45_wait_ready();
+    at45_select();
+    at45_spi_write(buf ? OP_BUF2_TO_PAGE_ERASE : OP_BUF1_TO_PAGE_ERASE);
+    at45_send_addr(page, 0);
+    at45_deselect();
+}
+
+void at45_page_to_buffer(uint8_t buf, unsigned int page)
 {
-    unsigned int addr;
+    at45_wait_ready();
+    at45_select();
+    at45_spi_write(buf ? OP_PAGE_TO_BUF2 : OP_PAGE_TO_BUF1);
+    at45_send_addr(page, 0);
+    at45_deselect();
+    at45_wait_ready();
+}
 
-    if (page >= AT45_NR_PAGES)
+int at45_read_start_at(unsigned int page, unsigned int offset)
+{
+    if (page >= at45_geometry.nr_pages || offset >= at45_geometry.page_size)
         return -1;
 
-    addr = page << (PAGE_OFFSET - 8);
+    at45_select();
+    at45_spi_write(OP_READ_CONTINUOUS_33);
+    at45_send_addr(page, offset);
+
+    return 0;
+}
+
+int at45_read_start_addr(uint32_t addr)
+{
+    if ((addr >> at45_geometry.page_shift) >= at45_geometry.nr_pages)
+        return -1;
+    if ((addr & ((1ul << at45_geometry.page_shift) - 1)) >=
+        at45_geometry.page_size)
+        return -1;
 
     at45_select();
     at45_spi_write(OP_READ_CONTINUOUS_33);
-    at45_spi_write(addr >> 8);
-    at45_spi_write(addr & 0xff);
-    at45_spi_write(0);
+    at45_send_addr24(addr);
 
     return 0;
 }
@@ -126,11 +216,59 @@ void at45_read_stop()
     at45_deselect();
 }
 
-int at45_init()
+static int at45_detect()
 {
+    unsigned char manufacturer, device_id;
     unsigned char status;
+    unsigned int i;
+
+    at45_select();
+    at45_spi_write(OP_READ_ID);
+    manufacturer = at45_spi_read();
+    device_id = at45_spi_read();
+    at45_spi_read(); /* device id, second byte */
+    at45_deselect();
+
+    if (manufacturer != AT45_MANUFACTURER_ATMEL)
+        goto unsupported;
+
+    for (i = 0; i < NR_PARTS; i++) {
+        if (pgm_read_byte(&at45_parts[i].device_id) == device_id)
+            break;
+    }
+    if (i == NR_PARTS)
+        goto unsupported;
+
+    at45_geometry.device_id = device_id;
+    at45_geometry.page_shift = pgm_read_byte(&at45_parts[i].page_shift);
+    at45_geometry.page_size = pgm_read_word(&at45_parts[i].page_size);
+    at45_geometry.nr_pages = pgm_read_word(&at45_parts[i].nr_pages);
+    at45_geometry.binary = 0;
+
+    status = at45_status_read();
+    if (status & STATUS_BINARY_PAGES) {
+        at45_geometry.binary = 1;
+        at45_geometry.page_shift--;
+        at45_geometry.page_size = 1 << at45_geometry.page_shift;
+    }
+
+    return 0;
+
+unsupported:
+    uart0_puts("id = ");
+    uart0_print_hex(manufacturer);
+    uart0_print_hex(device_id);
+    uart0_puts("\r\n");
+    return -1;
+}
+
+int at45_init()
+{
     unsigned char flags;
 
+    /* already done by the loader */
+    if (at45_geometry.device_id)
+        return 0;
 
     local_irq_save(flags);
     // MOSI and CLK are outputs
@@ -143,18 +281,51 @@ int at45_init()
     at45_deselect();
     local_irq_restore(flags);
 
-    status = at45_status_read();
+    return at45_detect();
+}
 
-    switch (status & 0x3c) {
-    case 0x38: /* AT45DB642x */
-    case 0x3c:
-        break;
-    default: /* Unsupported */
-        uart0_puts("status = ");
-        uart0_print_hex(status);
-        uart0_puts("\r\n");
-        return -1;
-    }
+void at45_sleep()
+{
+    if (at45_asleep)
+        return;
+
+    at45_select();
+    at45_spi_write(OP_DEEP_POWER_DOWN);
+    at45_deselect();
+    at45_asleep = 1;
+}
+
+void at45_wake()
+{
+    if (!at45_asleep)
+        return;
+
+    at45_select();
+    at45_spi_write(OP_RESUME);
+    at45_deselect();
+    _delay_us(AT45_RESUME_US);
+    at45_asleep = 0;
+}
+
+void at45_power_lost()
+{
+    at45_asleep = 0;
+}
+
+int at45_set_binary_mode()
+{
+    if (at45_geometry.binary)
+        return 0;
+
+    at45_select();
+    at45_spi_write(0x3d);
+    at45_spi_write(0x2a);
+    at45_spi_write(0x80);
+    at45_spi_write(0xa6);
+    at45_deselect();
+
+    while (0 == (at45_status_read() & STATUS_READY))
+        ;
 
     return 0;
 }
@@ -1,26 +1,76 @@
-/* AT45DB642x flash driver */
+/* AT45DB161/321/642 flash driver */
 #ifndef DISCONNECT_AT45_H
 #define DISCONNECT_AT45_H
+#include <stdint.h>
 #include <avr/io.h>
 
-#define AT45_PAGE_SIZE 1056
-#define AT45_NR_PAGES  8192
+#include "hal.h"
+
+/* Largest page supported, use for buffers */
+#define AT45_MAX_PAGE_SIZE 1056
+
+#define AT45_MANUFACTURER_ATMEL 0x1f
+
+/**
+ * Geometry of the detected part, filled by at45_init().
+ * Byte address of a page is (page << page_shift) | offset both in
+ * DataFlash and in binary (power-of-two) page mode.
+ */
+typedef struct {
+    uint8_t  device_id;     /* JEDEC device id, first byte */
+    uint8_t  page_shift;
+    uint16_t page_size;
+    uint16_t nr_pages;
+    uint8_t  binary;        /* power-of-two pages */
+} at45_geometry_t;
+
+extern at45_geometry_t at45_geometry;
+
+/* Deep power-down to first command, tRDPD */
+#define AT45_RESUME_US 35
+
+extern unsigned char at45_asleep;
+
+static inline
+uint16_t at45_page_size()
+{
+    return at45_geometry.page_size;
+}
+
+static inline
+uint16_t at45_nr_pages()
+{
+    return at45_geometry.nr_pages;
+}
+
+/* Continuous read, legacy 33MHz opcode */
+#define AT45_OP_READ 0x03
+
+static inline
+void at45_select()
+{
+    hal_flash_cs(0);
+}
+
+static inline
+void at45_deselect()
+{
+    hal_flash_cs(1);
+}
 
 static inline
 void at45_spi_write(unsigned char b)
 {
-    SPDR = b;
-    while (!(SPSR & (1 << SPIF)))
-        ;
+    hal_spi_start(b);
+    hal_spi_wait();
 }
 
 static inline
 unsigned char at45_spi_rdwr(unsigned char b)
 {
-    SPDR = b;
-    while (!(SPSR & (1 << SPIF)))
-        ;
-    return SPDR;
+    hal_spi_start(b);
+    hal_spi_wait();
+    return hal_spi_data();
 }
 
 static inline
@@ -30,29 +80,92 @@ unsigned char at45_spi_read()
 }
 
 
+/**
+ * Configure SPI, read JEDEC id and detect geometry.
+ */
 int at45_init();
 void at45_reset();
 
+/**
+ * Enter deep power-down, the device ignores everything but
+ * at45_wake() until then. Both are no-ops in the matching state.
+ */
+void at45_sleep();
+void at45_wake();
+
+/**
+ * Rail was switched off, the device powers up awake.
+ */
+void at45_power_lost();
+
+/**
+ * Switch device into binary (power-of-two) page mode. One-time
+ * programmable, takes effect after power cycle.
+ */
+int at45_set_binary_mode();
+
 /**
  * Write single page.
  */
 int at45_write_page(unsigned int page, const char *data);
 
 /**
- * Issue write single page commadn
+ * Start filling the SRAM buffer for page, data bytes follow via
+ * at45_spi_write(). Flash is not touched until at45_write_page_stop().
  */
 int at45_write_page_start(unsigned int page);
 
 /**
- * Wait unitil page is written
+ * Program the buffer into the page and wait until it is written
  */
 int at45_write_page_stop();
 
+/**
+ * Drop a partially filled buffer, the page keeps its old contents
+ */
+void at45_write_page_abort();
+
+/**
+ * Status register says the device is programming or transferring.
+ */
+int at45_busy();
+void at45_wait_ready();
+
+/**
+ * The two SRAM buffers, 0 or 1. One of them can be written while the
+ * other one is being programmed, at45_buffer_program() only waits for
+ * the previous operation and returns as soon as programming started.
+ */
+void at45_buffer_write(uint8_t buf, unsigned int offset,
+                       const uint8_t *data, unsigned int len);
+void at45_buffer_program(uint8_t buf, unsigned int page);
+
+/**
+ * Load a page into a buffer, waits until the transfer is done.
+ */
+void at45_page_to_buffer(uint8_t buf, unsigned int page);
+
+/**
+ * Issue continuous read command starting at byte offset within page.
+ * Bytes should be read manually, reading continues across pages.
+ */
+int at45_read_start_at(unsigned int page, unsigned int offset);
+
+/**
+ * Issue continuous read command at raw device address,
+ * (page << page_shift) | offset.
+ */
+int at45_read_start_addr(uint32_t addr);
+
 /**
  * Issue continuous read command.
  * Bytes should be read manually.
  */
-int at45_read_start(unsigned int page);
+static inline
+int at45_read_start(unsigned int page)
+{
+    return at45_read_start_at(page, 0);
+}
 
 /**
  * Finish continuous read operation, deselect device.
@@ -0,0 +1,141 @@
+/*
+ * Boot section, needs BOOTRST programmed and BOOTSZ = 4096 words.
+ *
+ * When fwupdate_request is armed the application flash is programmed
+ * from the image staged in the AT45, then the application is started.
+ * The application flash is being rewritten, so nothing outside
+ * .bootloader may be used here: no libc or libgcc calls, no .data/.bss.
+ */
+#include <avr/io.h>
+#include <avr/boot.h>
+#include <util/crc16.h>
+
+#include "fwupdate.h"
+#include "layout.h"
+
+#define BOOT_INLINE static inline __attribute__((always_inline))
+
+#define OP_READ_CONTINUOUS_33 0x03
+
+static void boot_main() BOOTLOADER_SECTION __attribute__((noinline, used));
+
+/* Must stay the first function of the section, see Makefile */
+void boot_entry() BOOTLOADER_SECTION __attribute__((naked, used));
+void boot_entry()
+{
+    asm volatile ("clr __zero_reg__");
+    SP = RAMEND;
+    boot_main();
+    asm volatile ("jmp 0");
+}
+
+BOOT_INLINE uint8_t boot_eeprom_read(uint16_t addr)
+{
+    while (EECR & (1 << EEWE))
+        ;
+    EEAR = addr;
+    EECR |= (1 << EERE);
+    return EEDR;
+}
+
+BOOT_INLINE void boot_eeprom_write(uint16_t addr, uint8_t value)
+{
+    while (EECR & (1 << EEWE))
+        ;
+    EEAR = addr;
+    EEDR = value;
+    EECR |= (1 << EEMWE);
+    EECR |= (1 << EEWE);
+}
+
+BOOT_INLINE uint8_t boot_spi(uint8_t b)
+{
+    SPDR = b;
+    while (!(SPSR & (1 << SPIF)))
+        ;
+    return SPDR;
+}
+
+BOOT_INLINE void boot_at45_read_start(uint32_t addr)
+{
+    PORTE &= ~(1 << PE5);
+    boot_spi(OP_READ_CONTINUOUS_33);
+    boot_spi(addr >> 16);
+    boot_spi(addr >> 8);
+    boot_spi(addr & 0xff);
+}
+
+BOOT_INLINE void boot_at45_read_stop()
+{
+    PORTE |= (1 << PE5);
+}
+
+static void boot_main()
+{
+    fwupdate_request_t request;
+    uint8_t *ptr = (uint8_t *) &request;
+    uint16_t eeaddr = (uint16_t) &fwupdate_request;
+    uint16_t crc = 0;
+    uint32_t addr;
+    uint16_t delay;
+    uint8_t i;
+
+    /* watchdog may still run after the reset requested by fwupdate */
+    WDTCR = (1 << WDCE) | (1 << WDE);
+    WDTCR = 0;
+
+    for (i = 0; i < sizeof(request); i++)
+        ptr[i] = boot_eeprom_read(eeaddr + i);
+
+    if (request.magic != FWUPDATE_MAGIC ||
+        request.length > LAYOUT_FIRMWARE_BYTES)
+        return;
+
+    /* flash power, SPI master, nCS */
+    DDRE |= (1 << PE7) | (1 << PE5);
+    PORTE &= ~(1 << PE7);
+    PORTE |= (1 << PE5);
+    DDRB |= (1 << PB2) | (1 << PB1) | (1 << PB0);
+    SPCR = (1 << SPE) | (1 << MSTR);
+    for (delay = 0; delay < 1000; delay++) /* flash power up */
+        asm volatile ("nop");
+
+    boot_at45_read_start(request.addr);
+    for (addr = 0; addr < request.length; addr++)
+        crc = _crc16_update(crc, boot_spi(0));
+    boot_at45_read_stop();
+
+    if (crc == request.crc16) {
+        boot_at45_read_start(request.addr);
+        for (addr = 0; addr < request.length; addr += SPM_PAGESIZE) {
+            uint16_t off;
+
+            boot_page_erase(addr);
+            boot_spm_busy_wait();
+
+            for (off = 0; off < SPM_PAGESIZE; off += 2) {
+                uint16_t word = 0xffff;
+
+                if (addr + off < request.length)
+                    word = (word & 0xff00) | boot_spi(0);
+                if (addr + off + 1 < request.length)
+                    word = (word & 0x00ff) | ((uint16_t) boot_spi(0) << 8);
+                boot_page_fill(addr + off, word);
+            }
+
+            boot_page_write(addr);
+            boot_spm_busy_wait();
+        }
+        boot_at45_read_stop();
+        boot_rww_enable();
+    }
+
+    /* disarm, a bad image is not retried */
+    boot_eeprom_write(eeaddr, 0xff);
+    boot_eeprom_write(eeaddr + 1, 0xff);
+    while (EECR & (1 << EEWE))
+        ;
+
+    SPCR = 0;
+    PORTE |= (1 << PE7);
+}
@@ -0,0 +1,73 @@
+#include <avr/io.h>
+
+#include "clock.h"
+#include "irq.h"
+#include "timer.h"
+#include "uart.h"
+
+unsigned char clock_div = 1;
+static unsigned int clock_ubrr; /* UBRR0 at F_CPU */
+
+static inline
+unsigned int ubrr_read()
+{
+    return ((unsigned int) UBRR0H << 8) | UBRR0L;
+}
+
+static inline
+void ubrr_write(unsigned int ubrr)
+{
+    UBRR0H = (unsigned char) (ubrr >> 8);
+    UBRR0L = (unsigned char) (ubrr & 0xff);
+}
+
+/* XDIV can only be changed while the divider is disabled */
+static void clock_set(unsigned char div)
+{
+    XDIV = 0;
+    if (div > 1)
+        XDIV = (1 << XDIVEN) | (129 - div);
+}
+
+void clock_full()
+{
+    unsigned char flags;
+
+    local_irq_save(flags);
+    if (clock_div != 1) {
+        clock_set(1);
+        timer_clock_div(1);
+        if (UCSR0B & ((1 << RXEN) | (1 << TXEN)))
+            ubrr_write(clock_ubrr);
+        clock_div = 1;
+    }
+    local_irq_restore(flags);
+}
+
+int clock_idle()
+{
+    unsigned char flags;
+    unsigned int ubrr;
+
+    if (CLOCK_IDLE_DIV == 1 || clock_div == CLOCK_IDLE_DIV)
+        return 0;
+
+    local_irq_save(flags);
+    if (UCSR0B & ((1 << RXEN) | (1 << TXEN))) {
+        /* baud = clk / 8 / (UBRR + 1), see UART_BAUD() */
+        ubrr = ubrr_read();
+        if (!uart0_tx_idle() || (ubrr + 1) % CLOCK_IDLE_DIV) {
+            local_irq_restore(flags);
+            return -1;
+        }
+        clock_ubrr = ubrr;
+        ubrr_write((ubrr + 1) / CLOCK_IDLE_DIV - 1);
+    }
+
+    clock_set(CLOCK_IDLE_DIV);
+    timer_clock_div(CLOCK_IDLE_DIV);
+    clock_div = CLOCK_IDLE_DIV;
+    local_irq_restore(flags);
+
+    return 0;
+}
@@ -0,0 +1,40 @@
+/* CPU clock scaling with the XDIV system clock divider */
+#ifndef DISCONNECT_CLOCK_H
+#define DISCONNECT_CLOCK_H
+#include <avr/io.h>
+
+/*
+ * Divider used while idle. Timer0 keeps HZ by dividing its prescaler
+ * by the same amount, so only 4, 8, 32 and 128 are possible.
+ */
+#ifndef CLOCK_IDLE_DIV
+# define CLOCK_IDLE_DIV 8
+#endif
+
+#if CLOCK_IDLE_DIV != 1 && CLOCK_IDLE_DIV != 4 && CLOCK_IDLE_DIV != 8 && \
+    CLOCK_IDLE_DIV != 32 && CLOCK_IDLE_DIV != 128
+# error "CLOCK_IDLE_DIV must be 1, 4, 8, 32 or 128"
+#endif
+
+extern unsigned char clock_div;
+
+/**
+ * Run at F_CPU. Required before playback, flash and UART transfers and
+ * anything using _delay_*(), which assume F_CPU.
+ */
+void clock_full();
+
+/**
+ * Divide the clock by CLOCK_IDLE_DIV. Refused (-1) while the UART is
+ * transmitting or its baud rate can't be kept with the divided clock.
+ */
+int clock_idle();
+
+/* Current CPU clock */
+static inline
+unsigned long clock_hz()
+{
+    return F_CPU / clock_div;
+}
+
+#endif /* DISCONNECT_CLOCK_H */
@@ -0,0 +1,74 @@
+"""Parallel, cached conversion of source audio to the device format"""
+import hashlib
+import os
+import subprocess
+
+from multiprocessing import Pool
+
+
+SAMPLE_RATE = 20833
+
+# sox output options, see the %.8wav rule in Makefile
+SOX_ARGS = ('--rate=%d' % SAMPLE_RATE, '-c1', '-1')
+
+CACHE_DIR = '.cache'
+
+
+class ConvertError(Exception):
+    pass
+
+
+def source_key(job):
+    """Cache key: hash of conversion parameters and source contents"""
+    fname, args = job
+    h = hashlib.sha1()
+    h.update('\0'.join(args) + '\0')
+    with open(fname, 'rb') as fp:
+        for chunk in iter(lambda: fp.read(1 << 16), ''):
+            h.update(chunk)
+    return h.hexdigest()
+
+
+def convert_one(job):
+    """Run sox, returns error message or None"""
+    fname, dest, args = job
+    tmp = dest + '.tmp.wav'
+    try:
+        subprocess.check_call(['sox', fname] + list(args) + [tmp])
+        os.rename(tmp, dest)
+    except (OSError, subprocess.CalledProcessError), e:
+        if os.path.exists(tmp):
+            os.unlink(tmp)
+        return 'sox %s: %s' % (fname, e)
+    return None
+
+
+def convert_all(fnames, jobs=None, cache_dir=CACHE_DIR, args=SOX_ARGS):
+    """Convert sources in a worker pool
+
+    Returns ({source: converted file}, number of conversions run).
+    Sources with a cached conversion are not converted again.
+    """
+    if not os.path.isdir(cache_dir):
+        os.makedirs(cache_dir)
+
+    sources = sorted(set(fnames))
+    pool = Pool(jobs)
+    try:
+        keys = pool.map(source_key, [(f, args) for f in sources])
+        result = {}
+        todo = {}
+        for fname, key in zip(sources, keys):
+            dest = os.path.join(cache_dir, key + '.wav')
+            result[fname] = dest
+            if not os.path.exists(dest):
+                todo[dest] = (fname, dest, args)
+
+        errors = [e for e in pool.map(convert_one, todo.values()) if e]
+    finally:
+        pool.close()
+        pool.join()
+
+    if errors:
+        raise ConvertError, '\n'.join(errors)
+    return result, len(todo)
@@ -1,13 +1,64 @@
 #ifndef DISCONNECT_CRC16_H
 #define DISCONNECT_CRC16_H
 #include <stdint.h>
+#include <avr/pgmspace.h>
 
-extern uint16_t const crc16_table[256];
+/*
+ * CRC-16 (poly 0x8005, reflected) engines, all give identical results:
+ *
+ *  CRC16_ENGINE_TABLE  - 256-entry table kept in program memory, read via LPM
+ *  CRC16_ENGINE_NIBBLE - 16-entry table in program memory, two lookups per byte
+ *  CRC16_ENGINE_SHIFT  - table-less shift/xor, avr-libc _crc16_update()
+ *
+ * Select with -DCRC16_ENGINE=<n>. Flash and cycles per byte, counted
+ * from the instructions with crc and data in registers (LPM is 3 cycles,
+ * pgm_read_word() two of them, a 16-bit shift by 4 is the 6-instruction
+ * swap sequence). `make crc16-sizes' prints the sizes, the loader `crc'
+ * command measures the cycles on the device, 256 bytes plus about 5
+ * cycles of loop per byte:
+ *
+ *  TABLE   512 bytes  15
+ *  NIBBLE   32 bytes  46, two nibble steps of 22 and the data >> 4
+ *  SHIFT     0 bytes  23, the _crc16_update() asm is 23 ALU instructions
+ */
+#define CRC16_ENGINE_TABLE  0
+#define CRC16_ENGINE_NIBBLE 1
+#define CRC16_ENGINE_SHIFT  2
+
+#ifndef CRC16_ENGINE
+# define CRC16_ENGINE CRC16_ENGINE_TABLE
+#endif
+
+#if CRC16_ENGINE == CRC16_ENGINE_TABLE
+
+extern uint16_t const crc16_table[256] PROGMEM;
 
 static inline uint16_t crc16_byte(uint16_t crc, const uint8_t data)
 {
-    return (crc >> 8) ^ crc16_table[(crc ^ data) & 0xff];
+    return (crc >> 8) ^ pgm_read_word(&crc16_table[(crc ^ data) & 0xff]);
 }
 
-#endif /* DISCONNECT_CRC16_H */
+#elif CRC16_ENGINE == CRC16_ENGINE_NIBBLE
+
+extern uint16_t const crc16_nibble_table[16] PROGMEM;
+
+static inline uint16_t crc16_byte(uint16_t crc, const uint8_t data)
+{
+    crc = (crc >> 4) ^ pgm_read_word(&crc16_nibble_table[(crc ^ data) & 0xf]);
+    crc = (crc >> 4) ^ pgm_read_word(&crc16_nibble_table[(crc ^ (data >> 4)) & 0xf]);
+    return crc;
+}
+
+#elif CRC16_ENGINE == CRC16_ENGINE_SHIFT
+#include <util/crc16.h>
+
+static inline uint16_t crc16_byte(uint16_t crc, const uint8_t data)
+{
+    return _crc16_update(crc, data);
+}
 
+#else
+# error "Unknown CRC16_ENGINE"
+#endif
+
+#endif /* DISCONNECT_CRC16_H */
@@ -1,3 +1,6 @@
+import array
+import sys
+
 # CRC table for the CRC-16. The poly is 0x8005 (x^16 + x^15 + x^2 + 1)
 crc16_table = \
    (0x0000, 0xC0C1, 0xC181, 0x0140, 0xC301, 0x03C0, 0x0280, 0xC241,
@@ -36,8 +39,29 @@ crc16_table = \
 def crc16_byte(crc, byte):
     return ((crc >> 8) ^ crc16_table[(crc ^ byte) & 0xff]) & 0xffff;
 
+# Same CRC over little-endian 16-bit words: crc = table[crc ^ word]
+_crc16_table16 = None
+
+def _table16():
+    global _crc16_table16
+    if _crc16_table16 is None:
+        t = crc16_table
+        _crc16_table16 = array.array(
+            'H', [(t[x & 0xff] >> 8) ^ t[((x >> 8) ^ t[x & 0xff]) & 0xff]
+                  for x in xrange(0x10000)])
+    return _crc16_table16
+
 def crc16(data):
+    table = _table16()
+    even = len(data) & ~1
+    words = array.array('H')
+    words.fromstring(str(data[:even]))
+    if sys.byteorder == 'big':
+        words.byteswap()
+
     crc = 0
-    for i in data:
-        crc = crc16_byte(crc, ord(i))
+    for word in words:
+        crc = table[crc ^ word]
+    if even != len(data):
+        crc = crc16_byte(crc, ord(str(data[-1:])))
     return crc
@@ -0,0 +1,19 @@
+#include "dsp.h"
+
+void dsp_fade_start(dsp_fade_t *f, uint8_t from, uint8_t to,
+                    uint16_t samples)
+{
+    int32_t distance = ((int32_t) to - from) << 8;
+
+    if (!samples) {
+        f->gain = (uint16_t) to << 8;
+        f->step = 0;
+        f->left = 0;
+        return;
+    }
+
+    /* the division rounds towards from, start off by the remainder */
+    f->step = distance / samples;
+    f->gain = ((uint16_t) to << 8) - (int32_t) f->step * samples;
+    f->left = samples;
+}
@@ -0,0 +1,279 @@
+#ifndef DISCONNECT_DSP_H
+#define DISCONNECT_DSP_H
+#include <stdint.h>
+
+/*
+ * Fixed-point kernels for one sample at a time, built on the MULSU and
+ * FMULS instructions of the atmega128. Samples are signed 8-bit, use
+ * dsp_s8()/dsp_u8() to get from and to the offset binary of the DAC.
+ * The host build has C versions giving identical results.
+ *
+ * Cycles per sample, counted from the instructions, inlined with the
+ * arguments in registers and the state in SRAM (loads and stores
+ * included). The loader `dsp' command measures them on the device:
+ *
+ *  dsp_gain      4
+ *  dsp_mix       3, 5 or 6 when it saturates
+ *  dsp_onepole  18
+ *  dsp_fade     about 32, most of it compiled C bookkeeping
+ *  dsp_biquad   79
+ */
+
+static inline
+int8_t dsp_s8(uint8_t v)
+{
+    return v ^ 0x80;
+}
+
+static inline
+uint8_t dsp_u8(int8_t s)
+{
+    return s ^ 0x80;
+}
+
+/**
+ * x * g / 256, g is 0..255 (up to 0.996), rounds towards minus infinity.
+ */
+static inline
+int8_t dsp_gain(int8_t x, uint8_t g)
+{
+#ifdef HOST
+    return (int16_t) x * g >> 8;
+#else
+    int8_t y;
+
+    asm ("mulsu %1, %2"         "\n\t"
+         "mov %0, r1"           "\n\t"
+         "clr __zero_reg__"
+         : "=r" (y)
+         : "a" (x), "a" (g));
+    return y;
+#endif
+}
+
+/**
+ * a + b, clamped to -128..127.
+ */
+static inline
+int8_t dsp_mix(int8_t a, int8_t b)
+{
+#ifdef HOST
+    int16_t s = a + b;
+
+    if (s > 127)
+        return 127;
+    if (s < -128)
+        return -128;
+    return s;
+#else
+    /* on overflow the sign flag still has the sign of the true sum */
+    asm ("add %0, %2"           "\n\t"
+         "brvc 1f"              "\n\t"
+         "ldi %0, 0x7f"         "\n\t"
+         "brge 1f"              "\n\t"
+         "ldi %0, 0x80"         "\n"
+         "1:"
+         : "=d" (a)
+         : "0" (a), "r" (b));
+    return a;
+#endif
+}
+
+/*
+ * One-pole low-pass, y += k / 256 * (x - y). The output is kept with 8
+ * fraction bits; a step larger than 127 is clamped, so a full-scale
+ * jump with k near 256 takes two samples. At 20.8 kHz k = 128 puts
+ * the -3 dB point at 2.4 kHz, k = 192 at 5.6 kHz.
+ */
+typedef struct {
+    int16_t s;              /* output << 8 */
+    uint8_t k;
+} dsp_onepole_t;
+
+#define DSP_ONEPOLE(k) {0, (k)}
+
+static inline
+int8_t dsp_onepole(dsp_onepole_t *f, int8_t x)
+{
+    int16_t s = f->s;
+#ifdef HOST
+    int16_t e = x - (s >> 8);
+
+    if (e > 127)
+        e = 127;
+    else if (e < -128)
+        e = -128;
+    s += e * f->k;
+#else
+    int8_t e = x;
+
+    asm ("sub %0, %B1"          "\n\t"
+         "brvc 1f"              "\n\t"
+         "ldi %0, 0x7f"         "\n\t"
+         "brge 1f"              "\n\t"
+         "ldi %0, 0x80"         "\n"
+         "1:"                   "\n\t"
+         "mulsu %0, %2"         "\n\t"
+         "add %A1, r0"          "\n\t"
+         "adc %B1, r1"          "\n\t"
+         "clr __zero_reg__"
+         : "+a" (e), "+r" (s)
+         : "a" (f->k));
+#endif
+    f->s = s;
+    return s >> 8;
+}
+
+/*
+ * Linear fade: the gain goes from one value to another (0..255, see
+ * dsp_gain()) over a number of samples, then stays.
+ */
+typedef struct {
+    uint16_t gain;          /* << 8 */
+    int16_t step;
+    uint16_t left;          /* samples */
+} dsp_fade_t;
+
+void dsp_fade_start(dsp_fade_t *f, uint8_t from, uint8_t to,
+                    uint16_t samples);
+
+static inline
+int8_t dsp_fade(dsp_fade_t *f, int8_t x)
+{
+    x = dsp_gain(x, f->gain >> 8);
+    if (f->left) {
+        f->gain += f->step;
+        f->left--;
+    }
+    return x;
+}
+
+/*
+ * Biquad, direct form I:
+ *
+ *  y = b0 x + b1 x1 + b2 x2 - a1 y1 - a2 y2
+ *
+ * Coefficients are Q2.6 (DSP_Q6(), -1.98..1.98), products go through
+ * FMULS into a 24-bit sum, y is rounded towards minus infinity and
+ * clamped. The state is 8-bit like the samples, so a filter with poles
+ * close to the unit circle can hum with a small limit cycle; fine for
+ * smoothing the DAC, not for narrow filters.
+ *
+ * dsp_biquad() relies on the order of the fields.
+ */
+typedef struct {
+    int8_t b0, b1, b2, a1, a2;
+    int8_t x1, x2, y1, y2;
+} dsp_biquad_t;
+
+#define DSP_Q6(c) ((int8_t) ((c) * 64 + ((c) < 0 ? -0.5 : 0.5)))
+#define DSP_BIQUAD(b0, b1, b2, a1, a2) \
+    {DSP_Q6(b0), DSP_Q6(b1), DSP_Q6(b2), DSP_Q6(a1), DSP_Q6(a2), 0, 0, 0, 0}
+
+#ifdef HOST
+static inline
+int16_t dsp_fmuls(int8_t a, int8_t b)
+{
+    return (int16_t) (a * b * 2);
+}
+#endif
+
+static inline
+int8_t dsp_biquad(dsp_biquad_t *f, int8_t x)
+{
+#ifdef HOST
+    int32_t acc = dsp_fmuls(x, f->b0) + dsp_fmuls(f->x1, f->b1) +
+        dsp_fmuls(f->x2, f->b2) - dsp_fmuls(f->y1, f->a1) -
+        dsp_fmuls(f->y2, f->a2);
+    int16_t v = acc >> 7;
+    int8_t y = v > 127 ? 127 : v < -128 ? -128 : v;
+
+    f->x2 = f->x1;
+    f->x1 = x;
+    f->y2 = f->y1;
+    f->y1 = y;
+    return y;
+#else
+    uint32_t acc;
+    int8_t c, v, ext, y;
+
+    asm volatile (
+        /* b0 x */
+        "ldd %[c], %a[f]+0"             "\n\t"
+        "fmuls %[x], %[c]"              "\n\t"
+        "movw %A[acc], r0"              "\n\t"
+        "clr %C[acc]"                   "\n\t"
+        "sbrc r1, 7"                    "\n\t"
+        "com %C[acc]"                   "\n\t"
+        /* + b1 x1 */
+        "ldd %[c], %a[f]+1"             "\n\t"
+        "ldd %[v], %a[f]+5"             "\n\t"
+        "fmuls %[v], %[c]"              "\n\t"
+        "clr %[ext]"                    "\n\t"
+        "sbrc r1, 7"                    "\n\t"
+        "com %[ext]"                    "\n\t"
+        "add %A[acc], r0"               "\n\t"
+        "adc %B[acc], r1"               "\n\t"
+        "adc %C[acc], %[ext]"           "\n\t"
+        /* + b2 x2 */
+        "ldd %[c], %a[f]+2"             "\n\t"
+        "ldd %[v], %a[f]+6"             "\n\t"
+        "fmuls %[v], %[c]"              "\n\t"
+        "clr %[ext]"                    "\n\t"
+        "sbrc r1, 7"                    "\n\t"
+        "com %[ext]"                    "\n\t"
+        "add %A[acc], r0"               "\n\t"
+        "adc %B[acc], r1"               "\n\t"
+        "adc %C[acc], %[ext]"           "\n\t"
+        /* - a1 y1 */
+        "ldd %[c], %a[f]+3"             "\n\t"
+        "ldd %[v], %a[f]+7"             "\n\t"
+        "fmuls %[v], %[c]"              "\n\t"
+        "clr %[ext]"                    "\n\t"
+        "sbrc r1, 7"                    "\n\t"
+        "com %[ext]"                    "\n\t"
+        "sub %A[acc], r0"               "\n\t"
+        "sbc %B[acc], r1"               "\n\t"
+        "sbc %C[acc], %[ext]"           "\n\t"
+        /* - a2 y2 */
+        "ldd %[c], %a[f]+4"             "\n\t"
+        "ldd %[v], %a[f]+8"             "\n\t"
+        "fmuls %[v], %[c]"              "\n\t"
+        "clr %[ext]"                    "\n\t"
+        "sbrc r1, 7"                    "\n\t"
+        "com %[ext]"                    "\n\t"
+        "sub %A[acc], r0"               "\n\t"
+        "sbc %B[acc], r1"               "\n\t"
+        "sbc %C[acc], %[ext]"           "\n\t"
+        "clr __zero_reg__"              "\n\t"
+        /* FMULS doubled every product, y = sum >> 7 */
+        "lsl %A[acc]"                   "\n\t"
+        "rol %B[acc]"                   "\n\t"
+        "rol %C[acc]"                   "\n\t"
+        "mov %[y], %B[acc]"             "\n\t"
+        /* in range if the high byte is the sign of the low one */
+        "mov %[ext], %B[acc]"           "\n\t"
+        "lsl %[ext]"                    "\n\t"
+        "sbc %[ext], %[ext]"            "\n\t"
+        "cp %[ext], %C[acc]"            "\n\t"
+        "breq 1f"                       "\n\t"
+        "ldi %[y], 0x7f"                "\n\t"
+        "sbrc %C[acc], 7"               "\n\t"
+        "ldi %[y], 0x80"                "\n"
+        "1:"                            "\n\t"
+        /* shift the state */
+        "ldd %[v], %a[f]+7"             "\n\t"
+        "std %a[f]+8, %[v]"             "\n\t"
+        "std %a[f]+7, %[y]"             "\n\t"
+        "ldd %[v], %a[f]+5"             "\n\t"
+        "std %a[f]+6, %[v]"             "\n\t"
+        "std %a[f]+5, %[x]"
+        : [acc] "=&r" (acc), [c] "=&a" (c), [v] "=&a" (v),
+          [ext] "=&r" (ext), [y] "=&d" (y)
+        : [f] "b" (f), [x] "a" (x)
+        : "memory");
+    return y;
+#endif
+}
+
+#endif /* DISCONNECT_DSP_H */
@@ -1,18 +1,130 @@
+import hashlib
+import json
+import os
 import struct
 import sys
+import time
 import wave
 
+from contextlib import contextmanager
+
+import convert
 from crc16 import crc16
 
 
+# JEDEC device id -> (name, pages, DataFlash page size)
+# Binary page mode rounds page size down to a power of two.
+GEOMETRIES = {
+    0x26: ('at45db161', 4096, 528),
+    0x27: ('at45db321', 8192, 528),
+    0x28: ('at45db642', 8192, 1056),
+}
+
+PARTS = dict((name, (pages, page_size))
+             for name, pages, page_size in GEOMETRIES.values())
+
 FLASH_PAGE_SIZE = 1056
 FLASH_PAGES = 8192
 
-SIGNATURE = 'v1\r\n'
+SIGNATURE = 'v4\r\n'
+
+# Catalog slot: threshold, sample, alias sample
+SLOT_SIZE = 16
+
+# Flash layout: two pointer records, content slots A and B and the
+# staged MCU firmware at the end (see layout.h). Recordings take the end
+# of slot B, slot bases don't move for them. Images use page numbers
+# relative to their slot.
+POINTER_PAGES = 2
+NR_SLOTS = 2
+RECORD_SHARE = 8
+POINTER_MAGIC = 'sp'
+FIRMWARE_BYTES = 0x1e000
+FIRMWARE_MAGIC = 0x5746
+
+# Sample is a list of extents: page, pages
+SAMPLE_EXTENTS = 0x80
+EXTENT_SIZE = 4
+
+# Sample head is also in the hot clip bank (see hot.h)
+SAMPLE_HOT = 0x40
+HOT_CLIP_MIN = 16
+SAMPLE_RATE = convert.SAMPLE_RATE
+
+
+def binary_page_size(page_size):
+    """Page size in binary (power-of-two) page mode"""
+    size = 1
+    while size * 2 <= page_size:
+        size *= 2
+    return size
+
+
+def page_shift(page_size):
+    """Bits of byte offset in AT45 address"""
+    shift = 0
+    while (1 << shift) < page_size:
+        shift += 1
+    return shift
+
+
+def flash_addr(offset, page_size=FLASH_PAGE_SIZE):
+    """Linear image offset to raw AT45 address"""
+    page, col = divmod(offset, page_size)
+    return (page << page_shift(page_size)) | col
+
+
+def firmware_base(nr_pages=FLASH_PAGES, page_size=FLASH_PAGE_SIZE):
+    """Staged firmware: header page, then the image"""
+    pages = 1 + (FIRMWARE_BYTES + page_size - 1) // page_size
+    return nr_pages - pages
 
 
-def pad_page(data):
-    padn = FLASH_PAGE_SIZE - len(data) % FLASH_PAGE_SIZE
+def record_base(nr_pages=FLASH_PAGES, page_size=FLASH_PAGE_SIZE):
+    """Recordings: catalog page, then the sample ring (see record.h)"""
+    return firmware_base(nr_pages, page_size) - nr_pages // RECORD_SHARE
+
+
+def slot_span(nr_pages=FLASH_PAGES, page_size=FLASH_PAGE_SIZE):
+    """Distance between the slot bases"""
+    return (firmware_base(nr_pages, page_size) - POINTER_PAGES) // NR_SLOTS
+
+
+def slot_base(slot, nr_pages=FLASH_PAGES, page_size=FLASH_PAGE_SIZE):
+    return POINTER_PAGES + slot * slot_span(nr_pages, page_size)
+
+
+def slot_pages(slot, nr_pages=FLASH_PAGES, page_size=FLASH_PAGE_SIZE,
+               recordings=True):
+    """Pages an image may use in slot, B ends at the recordings"""
+    if recordings and slot == NR_SLOTS - 1:
+        return (record_base(nr_pages, page_size) -
+                slot_base(slot, nr_pages, page_size))
+    return slot_span(nr_pages, page_size)
+
+
+def firmware_header(image):
+    """Header page of staged MCU firmware"""
+    return struct.pack('<HIH', FIRMWARE_MAGIC, len(image), crc16(image))
+
+
+def slot_pointer(generation, slot):
+    """Pointer record selecting the active slot"""
+    data = struct.pack('<2sIB', POINTER_MAGIC, generation, slot)
+    return data + struct.pack('<H', crc16(data))
+
+
+def parse_slot_pointer(data):
+    """Returns (generation, slot) or None if record is invalid"""
+    magic, generation, slot, crc = struct.unpack('<2sIBH', data[:9])
+    if magic != POINTER_MAGIC or slot >= NR_SLOTS or \
+       crc != crc16(data[:7]):
+        return None
+    return generation, slot
+
+
+def pad_page(data, page_size=FLASH_PAGE_SIZE):
+    padn = -len(data) % page_size
     return data + '\xff' * padn
 
 
@@ -40,22 +152,23 @@ class Sample:
         self.role = role
         self.weight = weight
         self.repeat = repeat
-        self.page = -1
-
-
-    def pages(self):
-        """Length in pages"""
-        return (len(self.wave) + FLASH_PAGE_SIZE) // FLASH_PAGE_SIZE
+        self.offset = -1    # byte offset in image (or of extent list)
+        self.key = None     # content hash
+        self.extents = None # [(page, pages)] when deduplicated
+        self.hot = 0        # bytes of the head in the hot clip bank
 
-    def tobin(self):
-        page = 0
-        pages, odd = divmod(len(self.wave), FLASH_PAGE_SIZE)
-        return struct.pack('<BBBHHH',
-                           self.role,
-                           self.weight,
-                           self.repeat,
-                           self.page,
-                           pages, odd)
+    def tobin(self, page_size=FLASH_PAGE_SIZE):
+        addr = flash_addr(self.offset, page_size)
+        length = len(self.wave)
+        repeat = self.repeat
+        if self.extents is not None:
+            repeat |= SAMPLE_EXTENTS
+        if self.hot:
+            repeat |= SAMPLE_HOT
+        return struct.pack('<BHBHB',
+                           repeat,
+                           addr & 0xffff, addr >> 16,
+                           length & 0xffff, length >> 16)
 
 ROLES_MAP = {
     'incoming': 0,    # Incoming call
@@ -85,31 +198,502 @@ def parse_fwin(fname):
                 repeat = int(parts[3])
             else:
                 repeat = 1
-            firmware.append(Sample(fname, role, weight, repeat))
+            if repeat >= SAMPLE_HOT:
+                raise FirmwareError, "%d: repeat is too large" % lineno
+            firmware.append((fname, role, weight, repeat))
         return firmware
 
-if __name__ == "__main__":
-    output = sys.stdout
 
-    if sys.argv < 2:
-        print >> sys.stderr, 'Syntax: %s <fw.in>' % sys.argv[0]
-        sys.exit(1)
+def load_samples(entries, sources=None):
+    """Load parse_fwin() entries, sources maps to converted files"""
+    sources = sources or {}
+    return [Sample(sources.get(fname, fname), role, weight, repeat)
+            for fname, role, weight, repeat in entries]
+
+
+class Stages(object):
+    """Per-stage wall clock timings"""
+
+    def __init__(self):
+        self.times = []
+
+    @contextmanager
+    def __call__(self, name):
+        start = time.time()
+        yield
+        self.times.append((name, time.time() - start))
+
+    def report(self, output=sys.stderr):
+        for name, seconds in self.times:
+            print >> output, '%-8s %8.3fs' % (name, seconds)
+
+
+def alias_table(weights):
+    """Walker alias table, returns [(threshold, index, alias index)]
+
+    Slot i is taken when a 16-bit coin is below threshold, otherwise
+    its alias is used.
+    """
+    n = len(weights)
+    total = float(sum(weights))
+    prob = [w * n / total for w in weights]
+    alias = range(n)
+    small = [i for i, p in enumerate(prob) if p < 1.0]
+    large = [i for i, p in enumerate(prob) if p >= 1.0]
+
+    while small and large:
+        s = small.pop()
+        l = large.pop()
+        alias[s] = l
+        prob[l] -= 1.0 - prob[s]
+        if prob[l] < 1.0:
+            small.append(l)
+        else:
+            large.append(l)
+
+    # leftovers are 1.0 up to rounding error
+    for i in small + large:
+        prob[i] = 1.0
+        alias[i] = i
+
+    return [(min(int(round(prob[i] * 65536)), 0xffff), i, alias[i])
+            for i in xrange(n)]
+
+
+def build_catalog(samples, page_size):
+    """Returns (role ranges, catalog slots data)"""
+    ranges = []
+    slots = []
+    for role in sorted(ROLES_MAP.values()):
+        members = [s for s in samples if s.role == role]
+        ranges.append((len(slots), len(members)))
+        if not members:
+            continue
+        weights = [max(s.weight, 1) for s in members]
+        for threshold, i, j in alias_table(weights):
+            slots.append(struct.pack('<H', threshold) +
+                         members[i].tobin(page_size) +
+                         members[j].tobin(page_size))
+    return ranges, ''.join(slots)
+
 
-    samples = parse_fwin(sys.argv[1])
+def report(samples, size, page_size, nr_pages, output=sys.stderr):
+    """Print flash utilisation"""
+    payload = sum(dict((s.offset, len(s.wave)) for s in samples).values())
+    pages = (size + page_size - 1) // page_size
+    print >> output, '%d samples, %d bytes of audio' % (len(samples), payload)
+    print >> output, '%d of %d pages used (%.1f%%), ' \
+          'audio is %.1f%% of that' % (
+        pages, nr_pages, 100.0 * pages / nr_pages,
+        100.0 * payload / (pages * page_size))
 
-    descr = ''
-    pageno = 1
+
+class Extents(object):
+    """Free byte ranges of the flash"""
+
+    def __init__(self, start, end):
+        self.free = [(start, end)]
+
+    def reserve(self, start, end):
+        result = []
+        for a, b in self.free:
+            if b <= start or a >= end:
+                result.append((a, b))
+                continue
+            if a < start:
+                result.append((a, start))
+            if b > end:
+                result.append((end, b))
+        self.free = result
+
+    def fits(self, start, end):
+        return any(a <= start and end <= b for a, b in self.free)
+
+    def alloc(self, size, align=1):
+        """Best fit allocation"""
+        best = None
+        for a, b in self.free:
+            start = (a + align - 1) // align * align
+            if start + size > b:
+                continue
+            if best is None or b - a < best[1]:
+                best = (start, b - a)
+        if best is None:
+            raise FirmwareError, "no free extent for %d bytes" % size
+        self.reserve(best[0], best[0] + size)
+        return best[0]
+
+
+def sample_key(sample):
+    if sample.key is None:
+        sample.key = hashlib.sha1(sample.wave.frames).hexdigest()
+    return sample.key
+
+
+def place_sequential(samples, catalog_pages, page_size):
+    """Pack samples back to back after the catalog"""
+    offset = (1 + catalog_pages) * page_size
     for sample in samples:
-        sample.page = pageno
-        pageno += sample.pages()
-        descr += sample.tobin()
+        sample.offset = offset
+        offset += len(sample.wave)
+    return 1
+
 
-    data = SIGNATURE
-    data += struct.pack('<BH', len(samples), crc16(descr))
-    data += descr
-    data = pad_page(data)
-    output.write(data)
+def place_stable(samples, catalog_pages, page_size, nr_pages, manifest):
+    """Keep samples where the previous layout put them
 
+    Samples are keyed by content hash, new or changed ones go to free
+    extents. Returns catalog page, manifest is updated in place.
+    """
+    if manifest.get('page_size') != page_size:
+        manifest.clear()
+    old = manifest.get('samples', {})
+    placed = {}
+
+    free = Extents(page_size, nr_pages * page_size)
     for sample in samples:
-        data = pad_page(sample.wave.frames)
-        output.write(data)
+        key = sample_key(sample)
+        if key in old and key not in placed:
+            placed[key] = old[key][0]
+            free.reserve(placed[key], placed[key] + len(sample.wave))
+
+    catalog_page = manifest.get('catalog_page')
+    catalog_size = catalog_pages * page_size
+    if not catalog_page or not free.fits(catalog_page * page_size,
+                                         catalog_page * page_size +
+                                         catalog_size):
+        catalog_page = free.alloc(catalog_size, page_size) // page_size
+    free.reserve(catalog_page * page_size,
+                 catalog_page * page_size + catalog_size)
+
+    for sample in samples:
+        key = sample_key(sample)
+        if key not in placed:
+            placed[key] = free.alloc(len(sample.wave))
+        sample.offset = placed[key]
+
+    manifest['page_size'] = page_size
+    manifest['catalog_page'] = catalog_page
+    manifest['samples'] = dict((sample_key(s), (s.offset, len(s.wave)))
+                               for s in samples)
+    return catalog_page
+
+
+def place_dedup(samples, catalog_pages, page_size, output=sys.stderr):
+    """Store every distinct page-sized chunk once
+
+    Samples become lists of page extents, the extent table follows the
+    catalog. Returns (catalog page, [(offset, data)]).
+    """
+    chunks = {}
+    order = []
+    for sample in samples:
+        frames = pad_page(sample.wave.frames, page_size)
+        sample.chunks = []
+        for offset in xrange(0, len(frames), page_size):
+            chunk = frames[offset:offset + page_size]
+            key = hashlib.sha1(chunk).digest()
+            if key not in chunks:
+                chunks[key] = len(order)
+                order.append(chunk)
+            sample.chunks.append(chunks[key])
+
+    nr_extents = 0
+    for sample in samples:
+        sample.extents = []
+        for chunk in sample.chunks:
+            if sample.extents and \
+               sum(sample.extents[-1]) == chunk and \
+               sample.extents[-1][1] < 0xffff:
+                sample.extents[-1][1] += 1
+            else:
+                sample.extents.append([chunk, 1])
+        nr_extents += len(sample.extents)
+
+    extents_page = 1 + catalog_pages
+    extents_pages = (nr_extents * EXTENT_SIZE + page_size - 1) // page_size
+    data_page = extents_page + extents_pages
+
+    table = []
+    offset = extents_page * page_size
+    for sample in samples:
+        sample.offset = offset + len(table) * EXTENT_SIZE
+        for chunk, pages in sample.extents:
+            table.append(struct.pack('<HH', data_page + chunk, pages))
+
+    total = sum(len(s.chunks) for s in samples)
+    print >> output, '%d of %d pages unique, %d extents' % (
+        len(order), total, nr_extents)
+
+    blobs = [(offset, ''.join(table))]
+    blobs.extend(((data_page + i) * page_size, chunk)
+                 for i, chunk in enumerate(order))
+    return 1, blobs
+
+
+class HotBank(object):
+    """Sample heads kept in MCU program memory
+
+    Heads of the first samples to play after a call starts are copied
+    to a C source linked into the firmware, playback starts from there
+    while the AT45 read is set up. Incoming comes first, then busy and
+    music, by weight within a role. Noise is left out, phone_wait_user()
+    plays it from the AT45 read primed while ringing.
+    """
+
+    def __init__(self, budget, clip_bytes):
+        self.budget = budget
+        self.clip_bytes = clip_bytes
+        self.clips = []     # (addr, cont, data)
+        self.bank_id = 0
+
+    def select(self, samples, page_size):
+        if any(s.extents is not None for s in samples):
+            raise FirmwareError, "hot clips do not support dedup"
+
+        order = sorted((s for s in samples if s.role != ROLES_MAP['noise']),
+                       key=lambda s: (s.role, -s.weight))
+        left = self.budget
+        heads = {}
+        for sample in order:
+            if sample.offset in heads:
+                continue
+            length = min(len(sample.wave), self.clip_bytes, left)
+            if length < HOT_CLIP_MIN:
+                continue
+            heads[sample.offset] = length
+            left -= length
+            self.clips.append((flash_addr(sample.offset, page_size),
+                               flash_addr(sample.offset + length, page_size),
+                               sample.wave.frames[:length]))
+            if len(self.clips) == 255:
+                break
+
+        for sample in samples:
+            sample.hot = heads.get(sample.offset, 0)
+
+        if self.clips:
+            data = ''.join(struct.pack('<II', addr, cont) + frames
+                           for addr, cont, frames in self.clips)
+            self.bank_id = crc16(data) or 1
+
+    def size(self):
+        return sum(len(frames) for addr, cont, frames in self.clips)
+
+    def write_c(self, fp, source):
+        def le24(addr):
+            return '{0x%02x, 0x%02x, 0x%02x}' % (
+                addr & 0xff, (addr >> 8) & 0xff, addr >> 16)
+
+        print >> fp, '/* Generated by firmware.py from %s, do not edit */' % \
+              source
+        print >> fp, '#include "hot.h"'
+        print >> fp
+        for i, (addr, cont, frames) in enumerate(self.clips):
+            print >> fp, 'static const uint8_t clip%d[] PROGMEM = {' % i
+            for j in xrange(0, len(frames), 12):
+                print >> fp, '    %s,' % ', '.join(
+                    '0x%02x' % ord(c) for c in frames[j:j + 12])
+            print >> fp, '};'
+            print >> fp
+        print >> fp, 'const hot_clip_t hot_clips[] PROGMEM = {'
+        for i, (addr, cont, frames) in enumerate(self.clips):
+            print >> fp, '    {%s, %s, %d, clip%d},' % (
+                le24(addr), le24(cont), len(frames), i)
+        if not self.clips:
+            print >> fp, '    {{0, 0, 0}, {0, 0, 0}, 0, 0},'
+        print >> fp, '};'
+        print >> fp, 'const uint8_t hot_nr_clips = %d;' % len(self.clips)
+        print >> fp, 'const uint16_t hot_bank_id = 0x%04x;' % self.bank_id
+
+
+def build_image(samples, page_size=FLASH_PAGE_SIZE, nr_pages=FLASH_PAGES,
+                manifest=None, base=None, dedup=False, hot=None):
+    """Build flash image
+
+    With manifest samples keep their previous places and free space is
+    filled from the base image, so unchanged pages stay identical.
+    With dedup identical pages are stored once. With a HotBank the
+    sample heads it selects are flagged and its id goes to the header.
+    """
+    if page_size % SLOT_SIZE:
+        raise FirmwareError, "page size must be multiple of %d" % SLOT_SIZE
+
+    nr_slots = len(samples)
+    catalog_pages = (nr_slots * SLOT_SIZE + page_size - 1) // page_size
+
+    if dedup:
+        if manifest is not None:
+            raise FirmwareError, "dedup does not support stable layout"
+        catalog_page, blobs = place_dedup(samples, catalog_pages, page_size)
+    elif manifest is None:
+        catalog_page = place_sequential(samples, catalog_pages, page_size)
+        blobs = [(s.offset, s.wave.frames) for s in samples]
+    else:
+        catalog_page = place_stable(samples, catalog_pages, page_size,
+                                    nr_pages, manifest)
+        blobs = [(s.offset, s.wave.frames) for s in samples]
+
+    end = max([(catalog_page + catalog_pages) * page_size] +
+              [offset + len(data) for offset, data in blobs])
+    if end > nr_pages * page_size:
+        raise FirmwareError, "image needs %d bytes, flash has %d" % (
+            end, nr_pages * page_size)
+
+    hot_id = 0
+    if hot is not None:
+        hot.select(samples, page_size)
+        hot_id = hot.bank_id
+
+    ranges, catalog = build_catalog(samples, page_size)
+
+    header = SIGNATURE
+    header += struct.pack('<HHHH', page_size, catalog_page, nr_slots,
+                          crc16(catalog))
+    for first, count in ranges:
+        header += struct.pack('<HH', first, count)
+    header += struct.pack('<H', hot_id)
+    header += struct.pack('<H', crc16(header))
+
+    image = bytearray(pad_page(base or '', page_size)[:end])
+    image.extend('\xff' * (end - len(image)))
+    image = pad_page(image, page_size)
+
+    def put(offset, data):
+        image[offset:offset + len(data)] = data
+
+    put(0, pad_page(header, page_size))
+    put(catalog_page * page_size, pad_page(catalog, page_size))
+    for offset, data in blobs:
+        put(offset, data)
+    return str(image)
+
+
+def changed_pages(image, base, page_size):
+    """Pages of image that differ from base"""
+    pages = []
+    for offset in xrange(0, len(image), page_size):
+        if image[offset:offset + page_size] != base[offset:offset + page_size]:
+            pages.append(offset // page_size)
+    return pages
+
+
+if __name__ == "__main__":
+    from optparse import OptionParser
+
+    parser = OptionParser(usage='%prog [options] <fw.in>')
+    parser.add_option("-p", "--part", dest="part", default="at45db642",
+                      help="Flash part, one of %s (default %%default)" %
+                      ', '.join(sorted(PARTS)))
+    parser.add_option("--binary", dest="binary", default=False,
+                      action="store_true",
+                      help="Flash is in binary (power-of-two) page mode")
+    parser.add_option("-d", "--device", dest="device",
+                      help="Query flash geometry from device on serial port")
+    parser.add_option("-l", "--layout", dest="layout",
+                      help="Keep samples at places recorded in layout "
+                      "manifest, update it")
+    parser.add_option("-b", "--base", dest="base",
+                      help="Image currently on the device, fills free space")
+    parser.add_option("--no-recordings", dest="recordings", default=True,
+                      action="store_false",
+                      help="Firmware is built with RECORD_REPLIES=0, the "
+                      "image may use all of slot B")
+    parser.add_option("--dedup", dest="dedup", default=False,
+                      action="store_true",
+                      help="Store identical pages of samples once")
+    parser.add_option("-c", "--convert", dest="convert", default=False,
+                      action="store_true",
+                      help="Convert sources with sox, results are cached")
+    parser.add_option("-j", "--jobs", dest="jobs", type="int",
+                      help="Parallel conversions (default: CPU count)")
+    parser.add_option("--cache", dest="cache", default=convert.CACHE_DIR,
+                      help="Conversion cache directory (default %default)")
+    parser.add_option("--hot-bank", dest="hot_bank",
+                      help="Write heads of the first samples to play as C "
+                      "source, build the firmware with HOT_BANK=<file>")
+    parser.add_option("--hot-ms", dest="hot_ms", type="int", default=200,
+                      help="Length of a hot clip (default %default ms)")
+    parser.add_option("--hot-budget", dest="hot_budget", type="int",
+                      default=16384,
+                      help="Program memory for hot clips, keep the firmware "
+                      "below 64K for LPM (default %default bytes)")
+
+    (options, args) = parser.parse_args()
+
+    if len(args) != 1:
+        parser.print_help(sys.stderr)
+        sys.exit(1)
+
+    if options.device:
+        from loader import Loader
+        loader = Loader(options.device)
+        loader.version()
+        page_size, nr_pages = loader.geometry()
+    else:
+        if options.part not in PARTS:
+            parser.error("unknown part %r" % options.part)
+        nr_pages, page_size = PARTS[options.part]
+        if options.binary:
+            page_size = binary_page_size(page_size)
+
+    stage = Stages()
+
+    with stage('parse'):
+        entries = parse_fwin(args[0])
+
+    sources = None
+    if options.convert:
+        with stage('convert'):
+            sources, converted = convert.convert_all(
+                [e[0] for e in entries], options.jobs, options.cache)
+        print >> sys.stderr, '%d of %d sources converted' % (
+            converted, len(sources))
+
+    with stage('load'):
+        samples = load_samples(entries, sources)
+
+    manifest = None
+    if options.layout:
+        manifest = {}
+        if os.path.exists(options.layout):
+            with open(options.layout, 'rt') as fp:
+                manifest = json.load(fp)
+
+    base = None
+    if options.base:
+        with open(options.base, 'rb') as fp:
+            base = fp.read()
+
+    # image must fit either content slot, B is the smaller one
+    nr_pages = slot_pages(NR_SLOTS - 1, nr_pages, page_size,
+                          options.recordings)
+
+    hot = None
+    if options.hot_bank:
+        hot = HotBank(options.hot_budget,
+                      options.hot_ms * SAMPLE_RATE // 1000)
+
+    with stage('build'):
+        image = build_image(samples, page_size, nr_pages, manifest, base,
+                            options.dedup, hot)
+    report(samples, len(image), page_size, nr_pages)
+
+    if hot is not None:
+        with open(options.hot_bank, 'wt') as fp:
+            hot.write_c(fp, args[0])
+        print >> sys.stderr, '%d hot clips, %d bytes, bank id %04x' % (
+            len(hot.clips), hot.size(), hot.bank_id)
+
+    if base is not None:
+        print >> sys.stderr, '%d pages differ from base image' % \
+              len(changed_pages(image, base, page_size))
+
+    if manifest is not None:
+        with open(options.layout, 'wt') as fp:
+            json.dump(manifest, fp, indent=1, sort_keys=True)
+
+    with stage('write'):
+        sys.stdout.write(image)
+        sys.stdout.flush()
+    stage.report()
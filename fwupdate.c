@@ -0,0 +1,60 @@
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <avr/eeprom.h>
+#include <avr/wdt.h>
+
+#include "at45.h"
+#include "crc16.h"
+#include "fwupdate.h"
+#include "layout.h"
+
+fwupdate_request_t fwupdate_request EEMEM;
+
+long fwupdate_verify(fwupdate_header_t *header)
+{
+    uint8_t *ptr = (uint8_t *) header;
+    uint16_t crc = 0;
+    unsigned int i;
+    uint32_t n;
+
+    if (at45_read_start(layout_firmware_base()))
+        return -1;
+    for (i = 0; i < sizeof(fwupdate_header_t); i++)
+        ptr[i] = at45_spi_read();
+    at45_read_stop();
+
+    if (header->magic != FWUPDATE_MAGIC ||
+        header->length == 0 || header->length > LAYOUT_FIRMWARE_BYTES)
+        return -1;
+
+    if (at45_read_start(layout_firmware_base() + 1))
+        return -1;
+    for (n = 0; n < header->length; n++)
+        crc = crc16_byte(crc, at45_spi_read());
+    at45_read_stop();
+
+    if (crc != header->crc16)
+        return -1;
+
+    return header->length;
+}
+
+void fwupdate_start(const fwupdate_header_t *header)
+{
+    fwupdate_request_t request;
+
+    request.magic = FWUPDATE_MAGIC;
+    request.addr = (uint32_t) (layout_firmware_base() + 1) <<
+        at45_geometry.page_shift;
+    request.length = header->length;
+    request.crc16 = header->crc16;
+
+    eeprom_write_block(&request, &fwupdate_request, sizeof(request));
+    eeprom_busy_wait();
+
+    /* reset into the boot section */
+    cli();
+    wdt_enable(WDTO_15MS);
+    while (1)
+        ;
+}
@@ -0,0 +1,39 @@
+/* MCU firmware update staged through the AT45 */
+#ifndef DISCONNECT_FWUPDATE_H
+#define DISCONNECT_FWUPDATE_H
+#include <stdint.h>
+
+#define FWUPDATE_MAGIC 0x5746 /* FW */
+
+/* First page of the AT45 firmware region, image follows on next page */
+typedef struct {
+    uint16_t magic;
+    uint32_t length;
+    uint16_t crc16;     /* of the image */
+} __attribute__((packed)) fwupdate_header_t;
+
+/*
+ * Update request in EEPROM, read by the boot section after reset.
+ * Stays armed until the application flash is programmed, so an
+ * interrupted update is restarted.
+ */
+typedef struct {
+    uint16_t magic;
+    uint32_t addr;      /* raw AT45 address of the image */
+    uint32_t length;
+    uint16_t crc16;
+} __attribute__((packed)) fwupdate_request_t;
+
+extern fwupdate_request_t fwupdate_request;
+
+/**
+ * Check staged image, returns its length or -1.
+ */
+long fwupdate_verify(fwupdate_header_t *header);
+
+/**
+ * Arm the boot section with a verified image and reset, doesn't return.
+ */
+void fwupdate_start(const fwupdate_header_t *header);
+
+#endif /* DISCONNECT_FWUPDATE_H */
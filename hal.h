@@ -0,0 +1,301 @@
+/* Board access: AVR registers, or the host model with make host */
+#ifndef DISCONNECT_HAL_H
+#define DISCONNECT_HAL_H
+#include <stdint.h>
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <avr/sleep.h>
+
+/*
+ * Pin functions take and return raw levels, most outputs are active low:
+ *
+ *  PORTC - speaker DAC (R-2R)
+ *  PB4   - COM cable plugged, start the loader
+ *  PB5   - handset on hook, also wired to INT2 (PD2)
+ *  PB6   - microphone toggle
+ *  PD4   - RTS, low: ready to receive
+ *  PE2   - LED, low: on
+ *  PE5   - AT45 chip select, low: selected
+ *  PE7   - speaker and flash rail, low: powered
+ *  PF0   - microphone, analog (ADC channel REC_ADC_CHANNEL, see record.h)
+ *  PG1   - ringer, toggled while ringing, high when idle
+ *
+ * Configuration registers (DDRx, SPCR, UCSR0B/C, UBRR0, TCCR0, OCR0,
+ * TIMSK, ASSR, XDIV) are written directly; on the host they are plain
+ * variables the model reads back.
+ */
+#ifdef HOST
+# include "host/hal_host.h"
+#else
+
+static inline
+void hal_dac_write(uint8_t v)
+{
+    PORTC = v;
+}
+
+static inline
+uint8_t hal_com()
+{
+    return PINB & (1 << PB4);
+}
+
+static inline
+uint8_t hal_hook()
+{
+    return PINB & (1 << PB5);
+}
+
+static inline
+uint8_t hal_mic()
+{
+    return PINB & (1 << PB6);
+}
+
+static inline
+void hal_rts(uint8_t level)
+{
+    if (level)
+        PORTD |= (1 << PD4);
+    else
+        PORTD &= ~(1 << PD4);
+}
+
+static inline
+void hal_led(uint8_t level)
+{
+    if (level)
+        PORTE |= (1 << PE2);
+    else
+        PORTE &= ~(1 << PE2);
+}
+
+static inline
+uint8_t hal_led_level()
+{
+    return PORTE & (1 << PE2);
+}
+
+static inline
+void hal_flash_cs(uint8_t level)
+{
+    if (level)
+        PORTE |= (1 << PE5);
+    else
+        PORTE &= ~(1 << PE5);
+}
+
+static inline
+void hal_rail(uint8_t level)
+{
+    if (level)
+        PORTE |= (1 << PE7);
+    else
+        PORTE &= ~(1 << PE7);
+}
+
+static inline
+void hal_ring(uint8_t level)
+{
+    if (level)
+        PORTG |= (1 << PG1);
+    else
+        PORTG &= ~(1 << PG1);
+}
+
+/* INT2 on the hook line: disable, select edge and clear flag, enable */
+static inline
+void hal_hook_irq_disable()
+{
+    EIMSK &= ~(1 << INT2);
+}
+
+static inline
+void hal_hook_irq_edge(uint8_t rising)
+{
+    EICRA = (EICRA & ~(3 << ISC20)) | ((rising ? 3 : 2) << ISC20);
+    EIFR = (1 << INTF2);
+}
+
+static inline
+void hal_hook_irq_enable()
+{
+    EIMSK |= (1 << INT2);
+}
+
+/*
+ * SPI master transfer in three steps, so the caller can work while
+ * the byte is shifted: start, wait for SPIF, fetch the received byte.
+ */
+static inline
+void hal_spi_start(uint8_t b)
+{
+    SPDR = b;
+}
+
+static inline
+void hal_spi_wait()
+{
+    while (!(SPSR & (1 << SPIF)))
+        ;
+}
+
+static inline
+uint8_t hal_spi_data()
+{
+    return SPDR;
+}
+
+/* UART0: UCSR0A status bits (RXC, TXC, UDRE, FE, DOR) and data */
+static inline
+uint8_t hal_uart_status()
+{
+    return UCSR0A;
+}
+
+static inline
+uint8_t hal_uart_read()
+{
+    return UDR0;
+}
+
+static inline
+void hal_uart_write(uint8_t c)
+{
+    UDR0 = c;
+}
+
+static inline
+void hal_uart_txc_clear()
+{
+    UCSR0A |= (1 << TXC);
+}
+
+/* Timer1 as a stopwatch, cs: 1 clk, 2 clk/8, 3 clk/64 */
+static inline
+void hal_timer1_start(uint8_t cs)
+{
+    TCCR1A = 0;
+    TCNT1 = 0;
+    TCCR1B = (cs << CS10);
+}
+
+static inline
+void hal_timer1_stop()
+{
+    TCCR1B = 0;
+}
+
+static inline
+uint8_t hal_timer1_running()
+{
+    return TCCR1B;
+}
+
+static inline
+uint16_t hal_timer1_read()
+{
+    return TCNT1;
+}
+
+/* Timer1 in CTC mode at clk, compare A vector every top + 1 cycles */
+static inline
+void hal_timer1_ctc(uint16_t top)
+{
+    TCCR1B = 0;
+    TCCR1A = 0;
+    TCNT1 = 0;
+    OCR1A = top;
+    TIFR = (1 << OCF1A);
+    TIMSK |= (1 << OCIE1A);
+    TCCR1B = (1 << WGM12) | (1 << CS10);
+}
+
+static inline
+void hal_timer1_ctc_stop()
+{
+    TCCR1B = 0;
+    TIMSK &= ~(1 << OCIE1A);
+}
+
+/* Timer2 in CTC mode at clk, compare vector every top + 1 cycles */
+static inline
+void hal_timer2_ctc(uint8_t top)
+{
+    TCCR2 = 0;
+    TCNT2 = 0;
+    OCR2 = top;
+    TIFR = (1 << OCF2);
+    TIMSK |= (1 << OCIE2);
+    TCCR2 = (1 << WGM21) | (1 << CS20);
+}
+
+static inline
+void hal_timer2_ctc_stop()
+{
+    TCCR2 = 0;
+    TIMSK &= ~(1 << OCIE2);
+}
+
+/*
+ * ADC, 8-bit left adjusted results against AVCC. clk/4 is above the
+ * 200 kHz the datasheet wants for 10 bits but fine for 8, a conversion
+ * takes 52 us at 1 MHz. Start a conversion, fetch its result once it's
+ * done, stop.
+ */
+static inline
+void hal_adc_start(uint8_t channel)
+{
+    ADMUX = (1 << REFS0) | (1 << ADLAR) | channel;
+    ADCSRA = (1 << ADEN) | (1 << ADSC) | (2 << ADPS0);
+}
+
+static inline
+void hal_adc_convert()
+{
+    ADCSRA |= (1 << ADSC);
+}
+
+static inline
+uint8_t hal_adc_read()
+{
+    return ADCH;
+}
+
+static inline
+void hal_adc_stop()
+{
+    ADCSRA = 0;
+}
+
+/* Timer0 count, fraction of the current tick */
+static inline
+uint8_t hal_timer0_count()
+{
+    return TCNT0;
+}
+
+/* Sleep in mode until an interrupt, irq state is left alone */
+static inline
+void hal_sleep(uint8_t mode)
+{
+    set_sleep_mode(mode);
+    sleep_mode();
+}
+
+/*
+ * Called with interrupts disabled: enable them and sleep, an interrupt
+ * can't slip in between as the instruction after sei runs first.
+ */
+static inline
+void hal_sleep_sei(uint8_t mode)
+{
+    set_sleep_mode(mode);
+    sleep_enable();
+    sei();
+    sleep_cpu();
+    sleep_disable();
+}
+
+#endif /* HOST */
+#endif /* DISCONNECT_HAL_H */
@@ -0,0 +1,43 @@
+/* EEPROM for the host build: EEMEM variables live in RAM */
+#ifndef DISCONNECT_HOST_AVR_EEPROM_H
+#define DISCONNECT_HOST_AVR_EEPROM_H
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+#define EEMEM
+
+static inline uint8_t eeprom_read_byte(const uint8_t *p)
+{
+    return *p;
+}
+
+static inline void eeprom_write_byte(uint8_t *p, uint8_t v)
+{
+    *p = v;
+}
+
+static inline void eeprom_update_byte(uint8_t *p, uint8_t v)
+{
+    *p = v;
+}
+
+static inline void eeprom_read_block(void *dst, const void *src, size_t n)
+{
+    memcpy(dst, src, n);
+}
+
+static inline void eeprom_write_block(const void *src, void *dst, size_t n)
+{
+    memcpy(dst, src, n);
+}
+
+static inline void eeprom_update_block(const void *src, void *dst, size_t n)
+{
+    memcpy(dst, src, n);
+}
+
+#define eeprom_is_ready()  1
+#define eeprom_busy_wait() do { } while (0)
+
+#endif /* DISCONNECT_HOST_AVR_EEPROM_H */
@@ -0,0 +1,20 @@
+/* Interrupts for the host build, vectors are run by host/host.c */
+#ifndef DISCONNECT_HOST_AVR_INTERRUPT_H
+#define DISCONNECT_HOST_AVR_INTERRUPT_H
+#include <avr/io.h>
+
+void cli(void);
+void sei(void);
+
+#define SIG_INTERRUPT2      host_vector_int2
+#define SIG_OUTPUT_COMPARE0 host_vector_timer0_comp
+#define SIG_OUTPUT_COMPARE2 host_vector_timer2_comp
+#define SIG_OUTPUT_COMPARE1A host_vector_timer1_compa
+#define SIG_UART0_RECV      host_vector_uart0_rx
+#define SIG_UART0_DATA      host_vector_uart0_udre
+#define SIG_ADC             host_vector_adc
+
+#define SIGNAL(vector) void vector(void)
+#define ISR(vector) void vector(void)
+
+#endif /* DISCONNECT_HOST_AVR_INTERRUPT_H */
@@ -0,0 +1,203 @@
+/* atmega128 registers for the host build, see host/host.c */
+#ifndef DISCONNECT_HOST_AVR_IO_H
+#define DISCONNECT_HOST_AVR_IO_H
+#include <stdint.h>
+
+/*
+ * Registers are plain variables: the model reads configuration back
+ * and data goes through hal.h. SREG is an accessor, every access is a
+ * point where pending interrupts are taken.
+ */
+#define HOST_REGS8(X) \
+    X(PORTA) X(PORTB) X(PORTC) X(PORTD) X(PORTE) X(PORTF) X(PORTG) \
+    X(DDRA) X(DDRB) X(DDRC) X(DDRD) X(DDRE) X(DDRF) X(DDRG) \
+    X(PINA) X(PINB) X(PINC) X(PIND) X(PINE) X(PINF) X(PING) \
+    X(SPCR) X(SPSR) X(SPDR) \
+    X(UCSR0A) X(UCSR0B) X(UCSR0C) X(UBRR0H) X(UBRR0L) X(UDR0) \
+    X(TCCR0) X(TCNT0) X(OCR0) X(ASSR) X(TIMSK) X(TIFR) \
+    X(TCCR1A) X(TCCR1B) X(ETIMSK) X(ETIFR) X(TCCR2) X(TCNT2) X(OCR2) \
+    X(EICRA) X(EICRB) X(EIMSK) X(EIFR) \
+    X(MCUCR) X(MCUCSR) X(XDIV) X(WDTCR) X(SFIOR) \
+    X(ADMUX) X(ADCSRA) X(ADCL) X(ADCH)
+
+#define HOST_REGS16(X) \
+    X(TCNT1) X(OCR1A) X(OCR1B) X(ICR1) X(ADC)
+
+#define HOST_REG8_DECLARE(r) extern volatile uint8_t r;
+#define HOST_REG16_DECLARE(r) extern volatile uint16_t r;
+HOST_REGS8(HOST_REG8_DECLARE)
+HOST_REGS16(HOST_REG16_DECLARE)
+
+volatile uint8_t *host_sreg(void);
+#define SREG (*host_sreg())
+#define SREG_I 7
+
+#define _BV(bit) (1 << (bit))
+
+#define PA0 0
+#define PA1 1
+#define PA2 2
+#define PA3 3
+#define PA4 4
+#define PA5 5
+#define PA6 6
+#define PA7 7
+#define PB0 0
+#define PB1 1
+#define PB2 2
+#define PB3 3
+#define PB4 4
+#define PB5 5
+#define PB6 6
+#define PB7 7
+#define PC0 0
+#define PD0 0
+#define PD1 1
+#define PD2 2
+#define PD3 3
+#define PD4 4
+#define PD5 5
+#define PD6 6
+#define PD7 7
+#define PE0 0
+#define PE1 1
+#define PE2 2
+#define PE3 3
+#define PE4 4
+#define PE5 5
+#define PE6 6
+#define PE7 7
+#define PF0 0
+#define PG0 0
+#define PG1 1
+#define PG2 2
+#define PG3 3
+#define PG4 4
+
+/* SPCR, SPSR */
+#define SPIE  7
+#define SPE   6
+#define DORD  5
+#define MSTR  4
+#define CPOL  3
+#define CPHA  2
+#define SPR1  1
+#define SPR0  0
+#define SPIF  7
+#define WCOL  6
+#define SPI2X 0
+
+/* UCSR0A, UCSR0B, UCSR0C */
+#define RXC    7
+#define TXC    6
+#define UDRE   5
+#define FE     4
+#define DOR    3
+#define UPE    2
+#define U2X    1
+#define MPCM   0
+#define RXCIE  7
+#define TXCIE  6
+#define UDRIE  5
+#define RXEN   4
+#define TXEN   3
+#define UCSZ2  2
+#define UCSZ1  2
+#define UCSZ0  1
+#define RXC0   RXC
+#define TXC0   TXC
+#define UDRE0  UDRE
+#define FE0    FE
+#define DOR0   DOR
+#define U2X0   U2X
+#define RXCIE0 RXCIE
+#define TXCIE0 TXCIE
+#define UDRIE0 UDRIE
+#define RXEN0  RXEN
+#define TXEN0  TXEN
+
+/* TCCR0, ASSR, TIMSK, TIFR */
+#define FOC0   7
+#define WGM00  6
+#define COM01  5
+#define COM00  4
+#define WGM01  3
+#define CS02   2
+#define CS01   1
+#define CS00   0
+#define AS0    3
+#define TCN0UB 2
+#define OCR0UB 1
+#define TCR0UB 0
+#define OCIE2  7
+#define TOIE2  6
+#define TICIE1 5
+#define OCIE1A 4
+#define OCIE1B 3
+#define TOIE1  2
+#define OCIE0  1
+#define TOIE0  0
+#define OCF2   7
+#define OCF1A  4
+#define OCF0   1
+#define TOV0   0
+
+/* TCCR2 */
+#define WGM20  6
+#define WGM21  3
+#define CS22   2
+#define CS21   1
+#define CS20   0
+
+/* TCCR1B */
+#define WGM13  4
+#define WGM12  3
+#define CS12   2
+#define CS11   1
+#define CS10   0
+
+/* EICRA, EIMSK, EIFR */
+#define ISC31  7
+#define ISC30  6
+#define ISC21  5
+#define ISC20  4
+#define ISC11  3
+#define ISC10  2
+#define ISC01  1
+#define ISC00  0
+#define INT3   3
+#define INT2   2
+#define INT1   1
+#define INT0   0
+#define INTF3  3
+#define INTF2  2
+#define INTF1  1
+#define INTF0  0
+
+/* MCUCR, XDIV, WDTCR */
+#define SE     5
+#define SM1    4
+#define SM0    3
+#define SM2    2
+#define XDIVEN 7
+#define WDCE   4
+#define WDE    3
+
+/* ADMUX, ADCSRA */
+#define REFS1  7
+#define REFS0  6
+#define ADLAR  5
+#define MUX0   0
+#define ADEN   7
+#define ADSC   6
+#define ADFR   5
+#define ADIF   4
+#define ADIE   3
+#define ADPS2  2
+#define ADPS1  1
+#define ADPS0  0
+
+#define RAMEND 0x10ff
+#define E2END  0x0fff
+
+#endif /* DISCONNECT_HOST_AVR_IO_H */
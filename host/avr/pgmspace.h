@@ -0,0 +1,19 @@
+/* Program memory is ordinary memory on the host */
+#ifndef DISCONNECT_HOST_AVR_PGMSPACE_H
+#define DISCONNECT_HOST_AVR_PGMSPACE_H
+#include <stdint.h>
+#include <string.h>
+
+#define PROGMEM
+#define PSTR(s) (s)
+
+#define pgm_read_byte(p)  (*(const uint8_t *) (p))
+#define pgm_read_word(p)  (*(const uint16_t *) (p))
+#define pgm_read_dword(p) (*(const uint32_t *) (p))
+#define pgm_read_ptr(p)   (*(void * const *) (p))
+
+#define memcpy_P memcpy
+#define strcmp_P strcmp
+#define strncmp_P strncmp
+
+#endif /* DISCONNECT_HOST_AVR_PGMSPACE_H */
@@ -0,0 +1,21 @@
+/* Sleep modes for the host build */
+#ifndef DISCONNECT_HOST_AVR_SLEEP_H
+#define DISCONNECT_HOST_AVR_SLEEP_H
+#include <avr/io.h>
+
+#define SLEEP_MODE_IDLE      0
+#define SLEEP_MODE_ADC       (1 << SM0)
+#define SLEEP_MODE_PWR_DOWN  (1 << SM1)
+#define SLEEP_MODE_PWR_SAVE  ((1 << SM0) | (1 << SM1))
+#define SLEEP_MODE_STANDBY   ((1 << SM1) | (1 << SM2))
+
+void host_sleep(void);
+
+#define set_sleep_mode(mode) \
+    (MCUCR = (MCUCR & ~((1 << SM0) | (1 << SM1) | (1 << SM2))) | (mode))
+#define sleep_enable()  (MCUCR |= (1 << SE))
+#define sleep_disable() (MCUCR &= ~(1 << SE))
+#define sleep_cpu()     host_sleep()
+#define sleep_mode()    do { sleep_enable(); sleep_cpu(); sleep_disable(); } while (0)
+
+#endif /* DISCONNECT_HOST_AVR_SLEEP_H */
@@ -0,0 +1,14 @@
+/* Watchdog for the host build: a reset ends the run */
+#ifndef DISCONNECT_HOST_AVR_WDT_H
+#define DISCONNECT_HOST_AVR_WDT_H
+
+#define WDTO_15MS 0
+#define WDTO_1S   6
+
+void host_reset(const char *why);
+
+#define wdt_enable(timeout) host_reset("watchdog")
+#define wdt_disable()       do { } while (0)
+#define wdt_reset()         do { } while (0)
+
+#endif /* DISCONNECT_HOST_AVR_WDT_H */
@@ -0,0 +1,364 @@
+/* AT45DB161/321/642 model on a memory-mapped image file */
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "host.h"
+#include "layout.h"
+
+#define OP_READ_STATUS          0xd7
+#define OP_READ_ID              0x9f
+#define OP_READ_CONTINUOUS      0xe8
+#define OP_READ_CONTINUOUS_33   0x03
+#define OP_PROGRAM_VIA_BUF1     0x82
+#define OP_BUF1_WRITE           0x84
+#define OP_BUF1_TO_PAGE_ERASE   0x83
+#define OP_BUF2_WRITE           0x87
+#define OP_BUF2_TO_PAGE_ERASE   0x86
+#define OP_PAGE_TO_BUF1         0x53
+#define OP_PAGE_TO_BUF2         0x55
+#define OP_DEEP_POWER_DOWN      0xb9
+#define OP_RESUME               0xab
+#define OP_BINARY_MODE          0x3d
+
+#define STATUS_READY            0x80
+#define STATUS_BINARY_PAGES     0x01
+
+/* Page erase and program time, typical tEP */
+#define PROGRAM_NS (17 * 1000000ull)
+/* Main memory page to buffer transfer, tXFR */
+#define TRANSFER_NS (200 * 1000ull)
+/* Deep power-down to standby, tRDPD */
+#define RESUME_NS (35 * 1000ull)
+
+typedef struct {
+    const char *name;
+    uint8_t device_id;
+    uint8_t page_shift;     /* DataFlash page mode */
+    uint16_t page_size;
+    uint16_t nr_pages;
+    uint8_t density;        /* status register bits 5:2 */
+} part_t;
+
+static const part_t parts[] = {
+    {"at45db161", 0x26, 10,  528, 4096, 0x2c},
+    {"at45db321", 0x27, 10,  528, 8192, 0x34},
+    {"at45db642", 0x28, 11, 1056, 8192, 0x3c},
+};
+
+#define NR_PARTS (sizeof(parts) / sizeof(parts[0]))
+
+static const part_t *part;
+static uint8_t *mem;
+static size_t mem_size;
+static unsigned int page_shift, page_size;
+static int binary;
+
+static int powered;
+static int asleep;
+static uint64_t busy_until;
+static uint8_t bufs[2][1056];
+/* buffer being programmed, the other one can be written meanwhile */
+static int busy_buf = -1;
+
+/* Command in progress: opcode, bytes clocked, address */
+static uint8_t op;
+static unsigned int op_len;
+static uint32_t op_addr;
+static size_t pos;
+static uint8_t binary_seq[3];
+
+static unsigned long pages_programmed, bytes_read, ignored;
+
+int flash_open(const char *fname, const char *name, int binary_pages)
+{
+    static const uint8_t erased[4096] = {[0 ... 4095] = 0xff};
+    struct stat st;
+    unsigned int i;
+    off_t size;
+    int fd;
+
+    for (i = 0; i < NR_PARTS; i++) {
+        if (!strcmp(parts[i].name, name))
+            break;
+    }
+    if (i == NR_PARTS) {
+        fprintf(stderr, "unknown part %s\n", name);
+        return -1;
+    }
+    part = &parts[i];
+    binary = binary_pages;
+    page_shift = part->page_shift - binary;
+    page_size = binary ? 1u << page_shift : part->page_size;
+    mem_size = (size_t) part->nr_pages * page_size;
+
+    fd = open(fname, O_RDWR | O_CREAT, 0644);
+    if (fd < 0 || fstat(fd, &st)) {
+        perror(fname);
+        return -1;
+    }
+
+    /* new or short files are padded with erased pages */
+    for (size = st.st_size; size < (off_t) mem_size; ) {
+        size_t n = mem_size - size;
+        ssize_t r;
+
+        if (n > sizeof(erased))
+            n = sizeof(erased);
+        r = pwrite(fd, erased, n, size);
+        if (r <= 0) {
+            perror(fname);
+            close(fd);
+            return -1;
+        }
+        size += r;
+    }
+
+    mem = mmap(NULL, mem_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mem == MAP_FAILED) {
+        perror(fname);
+        return -1;
+    }
+
+    memset(bufs, 0xff, sizeof(bufs));
+    return 0;
+}
+
+/*
+ * Copy a content image (firmware.py output) into slot A and clear the
+ * pointer records, the firmware then boots from slot A.
+ */
+int flash_load_slot(const char *fname)
+{
+    unsigned int fw_pages, slot_pages;
+    size_t offset = LAYOUT_POINTER_PAGES * page_size;
+    size_t len;
+    FILE *fp;
+
+    fw_pages = 1 + (LAYOUT_FIRMWARE_BYTES + page_size - 1) / page_size;
+    slot_pages = (part->nr_pages - fw_pages - LAYOUT_POINTER_PAGES) /
+        LAYOUT_NR_SLOTS;
+
+    fp = fopen(fname, "rb");
+    if (!fp) {
+        perror(fname);
+        return -1;
+    }
+    len = fread(mem + offset, 1, (size_t) slot_pages * page_size, fp);
+    if (!feof(fp)) {
+        fprintf(stderr, "%s: image is larger than a slot (%u pages)\n",
+                fname, slot_pages);
+        fclose(fp);
+        return -1;
+    }
+    fclose(fp);
+
+    memset(mem, 0xff, offset);
+    fprintf(stderr, "%s: %zu bytes in slot A\n", fname, len);
+    return 0;
+}
+
+void flash_power(int on)
+{
+    if (!on) {
+        /* the part powers up in standby with an erased buffer */
+        asleep = 0;
+        busy_until = 0;
+        busy_buf = -1;
+        op_len = 0;
+        memset(bufs, 0xff, sizeof(bufs));
+    }
+    powered = on;
+}
+
+static uint8_t flash_status()
+{
+    uint8_t status = part->density;
+
+    if (host_ns >= busy_until)
+        status |= STATUS_READY;
+    if (binary)
+        status |= STATUS_BINARY_PAGES;
+    return status;
+}
+
+/* Raw (page << shift) | offset address to image offset */
+static size_t flash_offset(uint32_t addr)
+{
+    unsigned int page = (addr >> page_shift) % part->nr_pages;
+    unsigned int col = (addr & ((1u << page_shift) - 1)) % page_size;
+
+    return (size_t) page * page_size + col;
+}
+
+static void flash_program(int buf, uint32_t addr)
+{
+    unsigned int page = (addr >> page_shift) % part->nr_pages;
+
+    memcpy(mem + (size_t) page * page_size, bufs[buf], page_size);
+    busy_until = host_ns + PROGRAM_NS;
+    busy_buf = buf;
+    pages_programmed++;
+    host_event("flash: program page %u from buffer %d", page, buf + 1);
+}
+
+static void flash_transfer(int buf, uint32_t addr)
+{
+    unsigned int page = (addr >> page_shift) % part->nr_pages;
+
+    memcpy(bufs[buf], mem + (size_t) page * page_size, page_size);
+    busy_until = host_ns + TRANSFER_NS;
+    busy_buf = buf;
+}
+
+/* Buffer an opcode writes or programs from, -1 for the others */
+static int flash_op_buf(uint8_t op)
+{
+    switch (op) {
+    case OP_BUF1_WRITE:
+    case OP_BUF1_TO_PAGE_ERASE:
+    case OP_PROGRAM_VIA_BUF1:
+    case OP_PAGE_TO_BUF1:
+        return 0;
+    case OP_BUF2_WRITE:
+    case OP_BUF2_TO_PAGE_ERASE:
+    case OP_PAGE_TO_BUF2:
+        return 1;
+    }
+    return -1;
+}
+
+uint8_t flash_xfer(uint8_t mosi)
+{
+    unsigned int n = op_len++;
+    uint8_t v;
+
+    if (!powered)
+        return 0;
+
+    if (n == 0) {
+        op = mosi;
+        /*
+         * only status reads and writes to the other buffer while busy,
+         * only resume while asleep
+         */
+        if ((asleep && op != OP_RESUME) ||
+            (host_ns < busy_until && op != OP_READ_STATUS &&
+             !((op == OP_BUF1_WRITE || op == OP_BUF2_WRITE) &&
+               flash_op_buf(op) != busy_buf))) {
+            ignored++;
+            op = 0;
+        }
+        op_addr = 0;
+        return 0xff;
+    }
+
+    switch (op) {
+    case OP_READ_STATUS:
+        return flash_status();
+
+    case OP_READ_ID:
+        if (n == 1)
+            return 0x1f;
+        if (n == 2)
+            return part->device_id;
+        return 0;
+
+    case OP_READ_CONTINUOUS_33:
+    case OP_READ_CONTINUOUS:
+        if (n <= 3) {
+            op_addr = (op_addr << 8) | mosi;
+            if (n == 3)
+                pos = flash_offset(op_addr);
+            return 0xff;
+        }
+        /* 0xe8 has four don't care bytes */
+        if (op == OP_READ_CONTINUOUS && n <= 7)
+            return 0xff;
+        v = mem[pos];
+        pos = (pos + 1) % mem_size;
+        bytes_read++;
+        return v;
+
+    case OP_BUF1_WRITE:
+    case OP_BUF2_WRITE:
+    case OP_PROGRAM_VIA_BUF1:
+        if (n <= 3) {
+            op_addr = (op_addr << 8) | mosi;
+            if (n == 3)
+                pos = (op_addr & ((1u << page_shift) - 1)) % page_size;
+            return 0xff;
+        }
+        bufs[flash_op_buf(op)][pos] = mosi;
+        pos = (pos + 1) % page_size;
+        return 0xff;
+
+    case OP_BUF1_TO_PAGE_ERASE:
+    case OP_BUF2_TO_PAGE_ERASE:
+    case OP_PAGE_TO_BUF1:
+    case OP_PAGE_TO_BUF2:
+        if (n <= 3)
+            op_addr = (op_addr << 8) | mosi;
+        return 0xff;
+
+    case OP_BINARY_MODE:
+        if (n <= 3)
+            binary_seq[n - 1] = mosi;
+        return 0xff;
+    }
+
+    return 0xff;
+}
+
+void flash_deselect()
+{
+    unsigned int len = op_len;
+
+    op_len = 0;
+    if (!powered || !len)
+        return;
+
+    switch (op) {
+    case OP_PROGRAM_VIA_BUF1:
+    case OP_BUF1_TO_PAGE_ERASE:
+    case OP_BUF2_TO_PAGE_ERASE:
+        if (len >= 4)
+            flash_program(flash_op_buf(op), op_addr);
+        break;
+
+    case OP_PAGE_TO_BUF1:
+    case OP_PAGE_TO_BUF2:
+        if (len >= 4)
+            flash_transfer(flash_op_buf(op), op_addr);
+        break;
+
+    case OP_DEEP_POWER_DOWN:
+        asleep = 1;
+        host_event("flash: deep power-down");
+        break;
+
+    case OP_RESUME:
+        if (asleep) {
+            asleep = 0;
+            busy_until = host_ns + RESUME_NS;
+            host_event("flash: resume");
+        }
+        break;
+
+    case OP_BINARY_MODE:
+        if (len == 4 && binary_seq[0] == 0x2a && binary_seq[1] == 0x80 &&
+            binary_seq[2] == 0xa6)
+            host_event("flash: binary page mode programmed, use -b");
+        break;
+    }
+}
+
+void flash_report()
+{
+    fprintf(stderr, "flash: %lu pages programmed, %lu bytes read, "
+            "%lu commands ignored\n", pages_programmed, bytes_read, ignored);
+}
@@ -0,0 +1,47 @@
+/* hal.h functions implemented by the host model, see host/host.c */
+#ifndef DISCONNECT_HOST_HAL_HOST_H
+#define DISCONNECT_HOST_HAL_HOST_H
+#include <stdint.h>
+
+void hal_dac_write(uint8_t v);
+uint8_t hal_com(void);
+uint8_t hal_hook(void);
+uint8_t hal_mic(void);
+void hal_rts(uint8_t level);
+void hal_led(uint8_t level);
+uint8_t hal_led_level(void);
+void hal_flash_cs(uint8_t level);
+void hal_rail(uint8_t level);
+void hal_ring(uint8_t level);
+
+void hal_hook_irq_disable(void);
+void hal_hook_irq_edge(uint8_t rising);
+void hal_hook_irq_enable(void);
+
+void hal_spi_start(uint8_t b);
+void hal_spi_wait(void);
+uint8_t hal_spi_data(void);
+
+uint8_t hal_uart_status(void);
+uint8_t hal_uart_read(void);
+void hal_uart_write(uint8_t c);
+void hal_uart_txc_clear(void);
+
+void hal_timer1_start(uint8_t cs);
+void hal_timer1_stop(void);
+uint8_t hal_timer1_running(void);
+uint16_t hal_timer1_read(void);
+void hal_timer1_ctc(uint16_t top);
+void hal_timer1_ctc_stop(void);
+void hal_timer2_ctc(uint8_t top);
+void hal_timer2_ctc_stop(void);
+void hal_adc_start(uint8_t channel);
+void hal_adc_convert(void);
+uint8_t hal_adc_read(void);
+void hal_adc_stop(void);
+uint8_t hal_timer0_count(void);
+
+void hal_sleep(uint8_t mode);
+void hal_sleep_sei(uint8_t mode);
+
+#endif /* DISCONNECT_HOST_HAL_HOST_H */
@@ -0,0 +1,1024 @@
+/*
+ * Host model of the board for `make host': clock, interrupts, pins,
+ * UART and SPI behind hal.h, the AT45 is in host/flash.c.
+ *
+ * Time is counted in nanoseconds of device time. Every HAL call and
+ * SREG access costs a CPU cycle, SPI bytes and UART frames take their
+ * shift time, busy waits their nominal delay, sleep jumps to the next
+ * wakeup. This is good for call flows and protocols, not for cycle
+ * counts.
+ */
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <getopt.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <avr/sleep.h>
+
+#include "hal.h"
+#include "host.h"
+
+#define HOST_REG8_DEFINE(r) volatile uint8_t r;
+#define HOST_REG16_DEFINE(r) volatile uint16_t r;
+HOST_REGS8(HOST_REG8_DEFINE)
+HOST_REGS16(HOST_REG16_DEFINE)
+
+/* Vectors, whichever the firmware defines */
+void host_vector_int2(void) __attribute__((weak));
+void host_vector_timer0_comp(void) __attribute__((weak));
+void host_vector_timer2_comp(void) __attribute__((weak));
+void host_vector_timer1_compa(void) __attribute__((weak));
+void host_vector_uart0_rx(void) __attribute__((weak));
+void host_vector_uart0_udre(void) __attribute__((weak));
+void host_vector_adc(void) __attribute__((weak));
+
+int firmware_main(void);
+
+uint64_t host_ns;
+static volatile uint8_t sreg;
+static int in_vector;
+static unsigned long irqs_taken;
+
+static int verbose;
+static uint64_t stop_ns;
+static volatile sig_atomic_t interrupted;
+
+static int realtime;
+static uint64_t rt_start, rt_next;
+
+/* Pins */
+static uint8_t com_level;
+static uint8_t led_level = 1;
+static uint8_t ring_level = 1;
+static uint8_t rail_level = 1;
+static uint8_t cs_level = 1;
+static uint8_t rts_level = 1;
+static uint64_t ring_last;
+static unsigned long ring_toggles;
+
+/* Speaker */
+static FILE *dac_fp;
+static unsigned long dac_writes;
+
+/* Hook script and INT2 */
+typedef struct {
+    uint64_t ns;
+    uint8_t on;     /* handset on hook */
+} hook_change_t;
+
+static hook_change_t *hook_script;
+static unsigned int hook_len, hook_pos;
+static uint8_t hook_on = 1;
+static uint8_t int2_rising, int2_enabled, int2_flag;
+
+/* Timer0 compare match, Timer1 stopwatch */
+static const uint16_t t0_prescale[8] = {0, 1, 8, 32, 64, 128, 256, 1024};
+static const uint16_t t1_prescale[8] = {0, 1, 8, 64, 256, 1024, 0, 0};
+static uint8_t t0_tccr = 0xff, t0_ocr, t0_assr, t0_xdiv;
+static uint64_t t0_period, t0_next;
+/* XDIV: how often and how long the clock was divided */
+static unsigned long clock_divisions;
+static uint64_t clock_divided_ns, clock_divided_since;
+static uint8_t t1_cs;
+static uint64_t t1_start;
+/* Timer1 CTC, see hal_timer1_ctc() */
+static uint64_t t1_period, t1_next;
+static uint8_t t1_flag;
+/* Timer2 CTC, see hal_timer2_ctc() */
+static uint64_t t2_period, t2_next;
+
+/*
+ * ADC: the microphone is a ramp, one step per conversion, or the bytes
+ * of a file (-a), looped. A result read before its conversion is done
+ * returns the previous one and is counted.
+ */
+static FILE *adc_fp;
+static uint8_t adc_ramp, adc_next;
+static uint64_t adc_done;
+static unsigned long adc_conversions, adc_early;
+
+/* SPI */
+static uint8_t spi_rx;
+static uint64_t spi_done;
+
+/* UART0 */
+static int uart_in = -1, uart_out = -1;
+static int uart_pty;
+static uint64_t rx_next;
+static uint8_t rx_data, rx_full, rx_dor;
+static uint64_t udr_free, tx_done, txc_cleared;
+static unsigned long rx_bytes, tx_bytes, tx_lost, rx_overruns;
+/* Line faults: ignore RTS, flip a bit in every Nth received byte */
+static int rts_ignored;
+static unsigned long rx_corrupt_every, rx_corrupted;
+
+static uint64_t wall_ns()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * NS_PER_SEC + ts.tv_nsec;
+}
+
+static unsigned int xdiv()
+{
+    if (XDIV & (1 << XDIVEN))
+        return 129 - (XDIV & 0x7f);
+    return 1;
+}
+
+static uint64_t cycles_ns(uint64_t cycles)
+{
+    return cycles * xdiv() * NS_PER_SEC / F_CPU;
+}
+
+void host_event(const char *fmt, ...)
+{
+    va_list ap;
+
+    if (!verbose)
+        return;
+
+    fprintf(stderr, "%12.6f ", host_ns / 1e9);
+    va_start(ap, fmt);
+    vfprintf(stderr, fmt, ap);
+    va_end(ap);
+    fputc('\n', stderr);
+}
+
+static void host_stop(const char *why)
+{
+    fflush(stdout);
+    fprintf(stderr, "stopped at %.6f s: %s\n", host_ns / 1e9, why);
+    fprintf(stderr, "dac: %lu writes, ring: %lu toggles\n",
+            dac_writes, ring_toggles);
+    fprintf(stderr, "uart: %lu bytes in (%lu corrupted), %lu out (%lu lost), "
+            "%lu overruns\n", rx_bytes, rx_corrupted, tx_bytes, tx_lost,
+            rx_overruns);
+    if (adc_conversions)
+        fprintf(stderr, "adc: %lu conversions, %lu read early\n",
+                adc_conversions, adc_early);
+    if (XDIV & (1 << XDIVEN))
+        clock_divided_ns += host_ns - clock_divided_since;
+    fprintf(stderr, "clock: divided %lu times, %.1f of %.1f s\n",
+            clock_divisions, clock_divided_ns / 1e9, host_ns / 1e9);
+    flash_report();
+    if (dac_fp)
+        fclose(dac_fp);
+    exit(0);
+}
+
+void host_reset(const char *why)
+{
+    host_stop(why);
+}
+
+static void host_sync()
+{
+    uint64_t wall;
+
+    if (host_ns < rt_next)
+        return;
+    rt_next = host_ns + 1000000;
+
+    wall = wall_ns() - rt_start;
+    if (host_ns > wall) {
+        struct timespec ts;
+
+        ts.tv_sec = (host_ns - wall) / NS_PER_SEC;
+        ts.tv_nsec = (host_ns - wall) % NS_PER_SEC;
+        nanosleep(&ts, NULL);
+    }
+}
+
+static void update_hook()
+{
+    while (hook_pos < hook_len && hook_script[hook_pos].ns <= host_ns) {
+        uint8_t on = hook_script[hook_pos++].on;
+
+        if (on == hook_on)
+            continue;
+        hook_on = on;
+        host_event("hook: %s", on ? "on" : "off");
+        /* INTF2 is set on the selected edge even while disabled */
+        if (on == int2_rising)
+            int2_flag = 1;
+    }
+}
+
+static void update_timer0()
+{
+    if (TCCR0 != t0_tccr || OCR0 != t0_ocr || ASSR != t0_assr ||
+        XDIV != t0_xdiv) {
+        uint64_t count = (uint64_t) t0_prescale[TCCR0 & 7] * (OCR0 + 1);
+
+        if ((XDIV ^ t0_xdiv) & (1 << XDIVEN)) {
+            if (XDIV & (1 << XDIVEN)) {
+                clock_divisions++;
+                clock_divided_since = host_ns;
+                host_event("clock: divided by %u", xdiv());
+            } else {
+                clock_divided_ns += host_ns - clock_divided_since;
+                host_event("clock: full");
+            }
+        }
+
+        t0_tccr = TCCR0;
+        t0_ocr = OCR0;
+        t0_assr = ASSR;
+        t0_xdiv = XDIV;
+
+        /* the crystal does not go through XDIV */
+        if (ASSR & (1 << AS0))
+            t0_period = count * NS_PER_SEC / 32768;
+        else
+            t0_period = cycles_ns(count);
+        t0_next = host_ns + t0_period;
+    }
+
+    while (t0_period && host_ns >= t0_next) {
+        TIFR |= (1 << OCF0);
+        t0_next += t0_period;
+    }
+}
+
+static void update_timer1()
+{
+    while (t1_period && host_ns >= t1_next) {
+        t1_flag = 1;
+        t1_next += t1_period;
+    }
+}
+
+static void update_timer2()
+{
+    while (t2_period && host_ns >= t2_next) {
+        TIFR |= (1 << OCF2);
+        t2_next += t2_period;
+    }
+}
+
+static uint64_t uart_frame_ns()
+{
+    unsigned int ubrr = ((unsigned int) UBRR0H << 8) | UBRR0L;
+    unsigned int div = (UCSR0A & (1 << U2X)) ? 8 : 16;
+
+    /* start, 8 data bits, stop */
+    return cycles_ns(10ull * div * (ubrr + 1));
+}
+
+/* RTS is honoured once the pin is an output, unless -n */
+static int uart_rts_hold()
+{
+    return !rts_ignored && (DDRD & (1 << PD4)) && rts_level;
+}
+
+static void update_uart()
+{
+    uint8_t c;
+    ssize_t n;
+
+    if (uart_in < 0 || !(UCSR0B & (1 << RXEN)) || host_ns < rx_next ||
+        uart_rts_hold())
+        return;
+
+    /* look again one frame later, the next byte can't come earlier */
+    rx_next = host_ns + uart_frame_ns();
+
+    n = read(uart_in, &c, 1);
+    if (n == 0 && uart_in == 0) {
+        uart_in = -1;
+        return;
+    }
+    if (n != 1)
+        return;
+
+    rx_bytes++;
+    if (rx_corrupt_every && rx_bytes % rx_corrupt_every == 0) {
+        c ^= 0x10;
+        rx_corrupted++;
+        host_event("uart: corrupted byte %lu", rx_bytes);
+    }
+    if (rx_full) {
+        rx_dor = 1;
+        rx_overruns++;
+        return;
+    }
+    rx_data = c;
+    rx_full = 1;
+}
+
+static int uart_udre()
+{
+    return host_ns >= udr_free;
+}
+
+static void run_vector(void (*vector)(void))
+{
+    irqs_taken++;
+    if (!vector)
+        return;
+
+    sreg &= ~(1 << SREG_I);
+    in_vector = 1;
+    host_ns += cycles_ns(8); /* entry and reti */
+    vector();
+    in_vector = 0;
+    sreg |= (1 << SREG_I);
+}
+
+static int irq_pending()
+{
+    return (int2_flag && int2_enabled) ||
+        ((TIFR & (1 << OCF2)) && (TIMSK & (1 << OCIE2))) ||
+        (t1_flag && (TIMSK & (1 << OCIE1A))) ||
+        ((TIFR & (1 << OCF0)) && (TIMSK & (1 << OCIE0))) ||
+        (rx_full && (UCSR0B & (1 << RXCIE))) ||
+        ((UCSR0B & (1 << UDRIE)) && uart_udre());
+}
+
+/* Take pending interrupts in vector priority order */
+static void take_irqs()
+{
+    while (!in_vector && (sreg & (1 << SREG_I))) {
+        if (int2_flag && int2_enabled) {
+            int2_flag = 0;
+            run_vector(host_vector_int2);
+        } else if ((TIFR & (1 << OCF2)) && (TIMSK & (1 << OCIE2))) {
+            TIFR &= ~(1 << OCF2);
+            run_vector(host_vector_timer2_comp);
+        } else if (t1_flag && (TIMSK & (1 << OCIE1A))) {
+            t1_flag = 0;
+            run_vector(host_vector_timer1_compa);
+        } else if ((TIFR & (1 << OCF0)) && (TIMSK & (1 << OCIE0))) {
+            TIFR &= ~(1 << OCF0);
+            run_vector(host_vector_timer0_comp);
+        } else if (rx_full && (UCSR0B & (1 << RXCIE))) {
+            run_vector(host_vector_uart0_rx);
+            /* a vector that doesn't read UDR0 would run forever */
+            rx_full = 0;
+        } else if ((UCSR0B & (1 << UDRIE)) && uart_udre()) {
+            run_vector(host_vector_uart0_udre);
+        } else {
+            break;
+        }
+    }
+}
+
+static void host_poll()
+{
+    if (interrupted)
+        host_stop("interrupted");
+    if (stop_ns && host_ns >= stop_ns)
+        host_stop("time limit");
+    if (realtime)
+        host_sync();
+
+    update_hook();
+    update_timer0();
+    update_timer1();
+    update_timer2();
+    update_uart();
+    take_irqs();
+}
+
+/*
+ * Busy waits run with interrupts enabled on the chip, a long step stops
+ * at every tick and UART frame in between so none of them is merged.
+ */
+void host_step(unsigned long cycles)
+{
+    uint64_t end = host_ns + cycles_ns(cycles);
+
+    while (1) {
+        uint64_t next = end;
+
+        if (t0_period && t0_next < next)
+            next = t0_next;
+        if (t1_period && t1_next < next)
+            next = t1_next;
+        if (t2_period && t2_next < next)
+            next = t2_next;
+        if (uart_in >= 0 && (UCSR0B & (1 << RXEN)) && rx_next > host_ns &&
+            rx_next < next)
+            next = rx_next;
+        if (next >= end)
+            break;
+        if (next > host_ns)
+            host_ns = next;
+        host_poll();
+    }
+    if (end > host_ns)
+        host_ns = end;
+    host_poll();
+}
+
+static void host_advance(uint64_t ns)
+{
+    if (ns > host_ns)
+        host_ns = ns;
+    host_poll();
+}
+
+void host_delay_us(double us)
+{
+    host_step((unsigned long) (us * F_CPU / 1e6));
+}
+
+volatile uint8_t *host_sreg()
+{
+    host_step(1);
+    return &sreg;
+}
+
+void cli()
+{
+    host_step(1);
+    sreg &= ~(1 << SREG_I);
+}
+
+void sei()
+{
+    sreg |= (1 << SREG_I);
+    host_step(1);
+}
+
+/*
+ * Sleep until an enabled interrupt is pending. Timer0 runs in idle and,
+ * on the crystal, in power-save; in power-down only INT2 wakes.
+ */
+static void host_sleep_mode(uint8_t mode)
+{
+    int t0_runs = mode == SLEEP_MODE_IDLE ||
+        (mode == SLEEP_MODE_PWR_SAVE && (ASSR & (1 << AS0)));
+
+    host_poll();
+    for (;;) {
+        unsigned long taken = irqs_taken;
+        uint64_t wake = UINT64_MAX;
+        uint64_t start = host_ns;
+
+        if (irq_pending())
+            return;
+
+        if (t0_runs && t0_period && (TIMSK & (1 << OCIE0)))
+            wake = t0_next;
+        if (mode == SLEEP_MODE_IDLE && t1_period &&
+            (TIMSK & (1 << OCIE1A)) && t1_next < wake)
+            wake = t1_next;
+        if (mode == SLEEP_MODE_IDLE && t2_period &&
+            (TIMSK & (1 << OCIE2)) && t2_next < wake)
+            wake = t2_next;
+        if (hook_pos < hook_len && hook_script[hook_pos].ns < wake)
+            wake = hook_script[hook_pos].ns;
+        if (mode == SLEEP_MODE_IDLE && uart_in >= 0 &&
+            (UCSR0B & (1 << RXCIE))) {
+            uint64_t rx = rx_next > host_ns ? rx_next : host_ns;
+
+            if (rx < wake)
+                wake = rx;
+        }
+        if (stop_ns && stop_ns < wake)
+            wake = stop_ns;
+
+        if (wake == UINT64_MAX)
+            host_stop("asleep with nothing to wake up");
+
+        host_advance(wake);
+        if (!t0_runs && t0_period)
+            t0_next += host_ns - start;
+
+        if (irqs_taken != taken || irq_pending())
+            return;
+    }
+}
+
+void host_sleep()
+{
+    host_sleep_mode(MCUCR & ((1 << SM0) | (1 << SM1) | (1 << SM2)));
+}
+
+/* hal.h */
+
+void hal_dac_write(uint8_t v)
+{
+    host_step(1);
+    PORTC = v;
+    dac_writes++;
+    if (dac_fp)
+        fprintf(dac_fp, "%llu %u\n", (unsigned long long) host_ns, v);
+}
+
+uint8_t hal_com()
+{
+    host_step(1);
+    return com_level ? (1 << PB4) : 0;
+}
+
+uint8_t hal_hook()
+{
+    host_step(1);
+    return hook_on ? (1 << PB5) : 0;
+}
+
+uint8_t hal_mic()
+{
+    host_step(1);
+    return 0;
+}
+
+void hal_rts(uint8_t level)
+{
+    host_step(1);
+    rts_level = level;
+}
+
+void hal_led(uint8_t level)
+{
+    host_step(1);
+    led_level = level;
+}
+
+uint8_t hal_led_level()
+{
+    host_step(1);
+    return led_level ? (1 << PE2) : 0;
+}
+
+void hal_flash_cs(uint8_t level)
+{
+    host_step(1);
+    if (level && !cs_level)
+        flash_deselect();
+    cs_level = level;
+}
+
+void hal_rail(uint8_t level)
+{
+    host_step(1);
+    if (level == rail_level)
+        return;
+    rail_level = level;
+    host_event("rail: %s", level ? "off" : "on");
+    flash_power(!level);
+}
+
+void hal_ring(uint8_t level)
+{
+    host_step(1);
+    if (level == ring_level)
+        return;
+    ring_level = level;
+    ring_toggles++;
+    if (host_ns - ring_last > 100000000)
+        host_event("ring");
+    ring_last = host_ns;
+}
+
+void hal_hook_irq_disable()
+{
+    host_step(1);
+    int2_enabled = 0;
+}
+
+void hal_hook_irq_edge(uint8_t rising)
+{
+    host_step(1);
+    int2_rising = rising ? 1 : 0;
+    int2_flag = 0;
+}
+
+void hal_hook_irq_enable()
+{
+    host_step(1);
+    int2_enabled = 1;
+}
+
+static unsigned int spi_div()
+{
+    static const uint8_t div[4] = {4, 16, 64, 128};
+
+    return div[SPCR & 3] >> (SPSR & (1 << SPI2X) ? 1 : 0);
+}
+
+void hal_spi_start(uint8_t b)
+{
+    host_step(1);
+    spi_rx = 0xff;
+    if (!cs_level && (SPCR & (1 << SPE)))
+        spi_rx = flash_xfer(b);
+    spi_done = host_ns + cycles_ns(8 * spi_div());
+}
+
+void hal_spi_wait()
+{
+    host_step(1);
+    host_advance(spi_done);
+}
+
+uint8_t hal_spi_data()
+{
+    host_step(1);
+    return spi_rx;
+}
+
+uint8_t hal_uart_status()
+{
+    uint8_t status = UCSR0A & (1 << U2X);
+
+    host_step(1);
+    if (rx_full)
+        status |= (1 << RXC);
+    if (rx_dor)
+        status |= (1 << DOR);
+    if (uart_udre())
+        status |= (1 << UDRE);
+    if (host_ns >= tx_done && tx_done > txc_cleared)
+        status |= (1 << TXC);
+    return status;
+}
+
+uint8_t hal_uart_read()
+{
+    host_step(1);
+    rx_full = 0;
+    rx_dor = 0;
+    return rx_data;
+}
+
+void hal_uart_write(uint8_t c)
+{
+    uint64_t start;
+
+    host_step(1);
+    start = tx_done > host_ns ? tx_done : host_ns;
+    udr_free = start;
+    tx_done = start + uart_frame_ns();
+    tx_bytes++;
+    if (uart_out < 0)
+        return;
+
+    /* like a cable nobody listens to, pty output is lost until opened */
+    if (uart_pty) {
+        struct pollfd pfd = {uart_out, POLLOUT, 0};
+
+        if (poll(&pfd, 1, 0) == 1 && (pfd.revents & POLLHUP)) {
+            tx_lost++;
+            return;
+        }
+    }
+    if (write(uart_out, &c, 1) != 1)
+        tx_lost++;
+}
+
+void hal_uart_txc_clear()
+{
+    host_step(1);
+    txc_cleared = host_ns;
+}
+
+void hal_timer1_start(uint8_t cs)
+{
+    host_step(1);
+    TCCR1A = 0;
+    TCCR1B = cs;
+    TCNT1 = 0;
+    t1_cs = cs;
+    t1_start = host_ns;
+}
+
+static uint16_t timer1_count()
+{
+    uint64_t div = (uint64_t) xdiv() * t1_prescale[t1_cs & 7];
+
+    if (!div)
+        return TCNT1;
+    return (host_ns - t1_start) * F_CPU / NS_PER_SEC / div;
+}
+
+void hal_timer1_stop()
+{
+    host_step(1);
+    TCNT1 = timer1_count();
+    TCCR1B = 0;
+    t1_cs = 0;
+}
+
+uint8_t hal_timer1_running()
+{
+    host_step(1);
+    return t1_cs;
+}
+
+uint16_t hal_timer1_read()
+{
+    host_step(1);
+    return timer1_count();
+}
+
+void hal_timer1_ctc(uint16_t top)
+{
+    host_step(1);
+    TCCR1A = 0;
+    OCR1A = top;
+    TCCR1B = (1 << WGM12) | (1 << CS10);
+    TIMSK |= (1 << OCIE1A);
+    t1_cs = 0;
+    t1_flag = 0;
+    t1_period = cycles_ns((uint64_t) top + 1);
+    t1_next = host_ns + t1_period;
+}
+
+void hal_timer1_ctc_stop()
+{
+    host_step(1);
+    TCCR1B = 0;
+    TIMSK &= ~(1 << OCIE1A);
+    t1_period = 0;
+    t1_flag = 0;
+}
+
+void hal_timer2_ctc(uint8_t top)
+{
+    host_step(1);
+    OCR2 = top;
+    TCCR2 = (1 << WGM21) | (1 << CS20);
+    TIFR &= ~(1 << OCF2);
+    TIMSK |= (1 << OCIE2);
+    t2_period = cycles_ns((uint64_t) top + 1);
+    t2_next = host_ns + t2_period;
+}
+
+void hal_timer2_ctc_stop()
+{
+    host_step(1);
+    TCCR2 = 0;
+    TIMSK &= ~(1 << OCIE2);
+    TIFR &= ~(1 << OCF2);
+    t2_period = 0;
+}
+
+static void adc_convert(unsigned int adc_clocks)
+{
+    unsigned int div = 1u << (ADCSRA & 7);
+    int c;
+
+    if (div == 1)
+        div = 2;
+    if (adc_fp) {
+        c = fgetc(adc_fp);
+        if (c == EOF) {
+            rewind(adc_fp);
+            c = fgetc(adc_fp);
+        }
+        adc_next = c == EOF ? 0x80 : c;
+    } else {
+        adc_next = adc_ramp++;
+    }
+    adc_done = host_ns + cycles_ns((uint64_t) adc_clocks * div);
+    adc_conversions++;
+}
+
+void hal_adc_start(uint8_t channel)
+{
+    host_step(1);
+    ADMUX = (1 << REFS0) | (1 << ADLAR) | channel;
+    ADCSRA = (1 << ADEN) | (1 << ADSC) | (2 << ADPS0);
+    /* the first conversion initializes the analog circuitry */
+    adc_convert(25);
+}
+
+void hal_adc_convert()
+{
+    host_step(1);
+    if (ADCSRA & (1 << ADEN))
+        adc_convert(13);
+}
+
+uint8_t hal_adc_read()
+{
+    host_step(1);
+    if (host_ns >= adc_done)
+        ADCH = adc_next;
+    else
+        adc_early++;
+    return ADCH;
+}
+
+void hal_adc_stop()
+{
+    host_step(1);
+    ADCSRA = 0;
+}
+
+uint8_t hal_timer0_count()
+{
+    host_step(1);
+    if (!t0_period)
+        return TCNT0;
+    return (t0_period - (t0_next - host_ns)) * (OCR0 + 1) / t0_period;
+}
+
+void hal_sleep(uint8_t mode)
+{
+    set_sleep_mode(mode);
+    host_sleep_mode(mode);
+}
+
+void hal_sleep_sei(uint8_t mode)
+{
+    set_sleep_mode(mode);
+    sreg |= (1 << SREG_I);
+    host_sleep_mode(mode);
+}
+
+/* Options */
+
+static int parse_hook(const char *script)
+{
+    const char *p = script;
+
+    while (*p) {
+        char state[4];
+        unsigned long ms;
+        int n;
+
+        if (sscanf(p, "%lu:%3[onf]%n", &ms, state, &n) != 2 ||
+            (strcmp(state, "on") && strcmp(state, "off")))
+            return -1;
+
+        hook_script = realloc(hook_script,
+                              (hook_len + 1) * sizeof(*hook_script));
+        hook_script[hook_len].ns = ms * 1000000ull;
+        hook_script[hook_len].on = !strcmp(state, "on");
+        if (hook_len && hook_script[hook_len].ns < hook_script[hook_len - 1].ns)
+            return -1;
+        hook_len++;
+
+        p += n;
+        if (*p == ',')
+            p++;
+        else if (*p)
+            return -1;
+    }
+    return 0;
+}
+
+static int open_uart(const char *port)
+{
+    if (!strcmp(port, "none"))
+        return 0;
+
+    if (!strcmp(port, "-")) {
+        uart_in = 0;
+        uart_out = 1;
+    } else if (!strcmp(port, "pty")) {
+        int fd = posix_openpt(O_RDWR | O_NOCTTY);
+        struct termios tio;
+        int slave;
+
+        if (fd < 0 || grantpt(fd) || unlockpt(fd)) {
+            perror("pty");
+            return -1;
+        }
+
+        /* no echo or line editing before the client configures it */
+        slave = open(ptsname(fd), O_RDWR | O_NOCTTY);
+        if (slave >= 0 && !tcgetattr(slave, &tio)) {
+            cfmakeraw(&tio);
+            tcsetattr(slave, TCSANOW, &tio);
+        }
+        if (slave >= 0)
+            close(slave);
+
+        fprintf(stderr, "uart on %s\n", ptsname(fd));
+        uart_in = uart_out = fd;
+        uart_pty = 1;
+        realtime = 1;
+    } else {
+        fprintf(stderr, "unknown uart %s\n", port);
+        return -1;
+    }
+
+    fcntl(uart_in, F_SETFL, fcntl(uart_in, F_GETFL) | O_NONBLOCK);
+    fcntl(uart_out, F_SETFL, fcntl(uart_out, F_GETFL) | O_NONBLOCK);
+    return 0;
+}
+
+static void on_sigint(int sig)
+{
+    (void) sig;
+    interrupted = 1;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "usage: %s [options] <flash image>\n"
+            "  -p PART    at45db161, at45db321 or at45db642 (default)\n"
+            "  -b         flash in binary (power-of-two) page mode\n"
+            "  -s IMAGE   put a content image into slot A, clear pointers\n"
+            "  -k SCRIPT  hook changes, ms:on|off,... (starts on hook)\n"
+            "  -l         COM cable plugged, run the loader\n"
+            "  -u PORT    uart on - (stdio), pty or none (default)\n"
+            "  -r         run in real time, implied by -u pty\n"
+            "  -n         no RTS wire, bytes arrive at line rate\n"
+            "  -e N       flip a bit in every Nth received byte\n"
+            "  -d FILE    log DAC writes as <ns> <value> lines\n"
+            "  -a FILE    microphone samples, unsigned 8-bit (default a ramp)\n"
+            "  -t SECONDS stop after this much device time\n"
+            "  -v         print events\n", prog);
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    const char *part = "at45db642";
+    const char *slot = NULL;
+    int binary = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "p:bs:k:lu:rne:d:a:t:v")) != -1) {
+        switch (opt) {
+        case 'p':
+            part = optarg;
+            break;
+        case 'b':
+            binary = 1;
+            break;
+        case 's':
+            slot = optarg;
+            break;
+        case 'k':
+            if (parse_hook(optarg)) {
+                fprintf(stderr, "bad hook script %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 'l':
+            com_level = 1;
+            break;
+        case 'u':
+            if (open_uart(optarg))
+                return 1;
+            break;
+        case 'r':
+            realtime = 1;
+            break;
+        case 'n':
+            rts_ignored = 1;
+            break;
+        case 'e':
+            rx_corrupt_every = strtoul(optarg, NULL, 0);
+            break;
+        case 'd':
+            dac_fp = fopen(optarg, "w");
+            if (!dac_fp) {
+                perror(optarg);
+                return 1;
+            }
+            break;
+        case 'a':
+            adc_fp = fopen(optarg, "rb");
+            if (!adc_fp) {
+                perror(optarg);
+                return 1;
+            }
+            break;
+        case 't':
+            stop_ns = (uint64_t) (atof(optarg) * NS_PER_SEC);
+            break;
+        case 'v':
+            verbose = 1;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+
+    if (optind != argc - 1)
+        usage(argv[0]);
+
+    if (flash_open(argv[optind], part, binary))
+        return 1;
+    if (slot && flash_load_slot(slot))
+        return 1;
+
+    signal(SIGINT, on_sigint);
+    signal(SIGTERM, on_sigint);
+    rt_start = wall_ns();
+
+    firmware_main();
+    host_stop("firmware returned");
+    return 0;
+}
@@ -0,0 +1,30 @@
+/* Host model internals shared by host/host.c and host/flash.c */
+#ifndef DISCONNECT_HOST_HOST_H
+#define DISCONNECT_HOST_HOST_H
+#include <stdint.h>
+
+#define NS_PER_SEC 1000000000ull
+
+/* Model time since reset */
+extern uint64_t host_ns;
+
+/* Advance the model clock by CPU cycles, take due interrupts */
+void host_step(unsigned long cycles);
+
+/* Print an event with the model time when -v is given */
+void host_event(const char *fmt, ...)
+    __attribute__((format(printf, 1, 2)));
+
+/*
+ * AT45 model on an image file laid out as nr_pages * page_size bytes.
+ * flash_xfer() is one SPI byte while selected, flash_deselect() ends
+ * the command.
+ */
+int flash_open(const char *fname, const char *part, int binary);
+int flash_load_slot(const char *fname);
+void flash_power(int on);
+uint8_t flash_xfer(uint8_t mosi);
+void flash_deselect(void);
+void flash_report(void);
+
+#endif /* DISCONNECT_HOST_HOST_H */
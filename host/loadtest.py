@@ -0,0 +1,146 @@
+"""Run loader.py against disconnect-host on a pty and check the result
+
+Starts the host model with the COM cable plugged, loads an image with
+loader.py, stops the model and compares the active slot of the flash
+image file with the input. Prints loader throughput and the UART
+counters of the model; -e and -n inject line faults to exercise the
+retry path.
+"""
+import os
+import re
+import shlex
+import shutil
+import signal
+import subprocess
+import sys
+import tempfile
+import time
+
+TOP = os.path.dirname(os.path.dirname(os.path.abspath(__file__)))
+sys.path.insert(0, TOP)
+
+from firmware import PARTS, POINTER_PAGES, parse_slot_pointer, slot_base
+
+
+class LoadTestError(Exception):
+    pass
+
+
+def start_host(host, part, flash, faults):
+    """Start the model, returns (process, pty name)"""
+    args = [host, '-p', part, '-l', '-u', 'pty'] + faults + [flash]
+    proc = subprocess.Popen(args, stderr=subprocess.PIPE)
+    while True:
+        line = proc.stderr.readline()
+        if not line:
+            raise LoadTestError, '%s exited: %r' % (host, proc.wait())
+        m = re.match(r'uart on (\S+)', line)
+        if m:
+            return proc, m.group(1)
+
+
+def stop_host(proc):
+    """SIGTERM, returns the summary the model prints"""
+    proc.send_signal(signal.SIGTERM)
+    summary = proc.stderr.read()
+    proc.wait()
+    return summary
+
+
+def active_slot(flash, part):
+    """Image bytes of the slot the newest pointer record selects"""
+    nr_pages, page_size = PARTS[part]
+    with open(flash, 'rb') as fp:
+        records = []
+        for page in xrange(POINTER_PAGES):
+            fp.seek(page * page_size)
+            pointer = parse_slot_pointer(fp.read(page_size))
+            if pointer:
+                records.append(pointer)
+        if not records:
+            raise LoadTestError, 'no valid slot pointer'
+        generation, slot = max(records)
+        fp.seek(slot_base(slot, nr_pages, page_size) * page_size)
+        return generation, slot, fp.read()
+
+
+def run(options, image, flash):
+    faults = []
+    if options.no_rts:
+        faults.append('-n')
+    if options.corrupt:
+        faults += ['-e', str(options.corrupt)]
+
+    proc, pty = start_host(options.host, options.part, flash, faults)
+    loader = shlex.split(options.loader) + ['-d', pty, '--no-rtscts',
+                                            '--stats', '-l', image]
+    start = time.time()
+    try:
+        output = subprocess.Popen(loader, stdout=subprocess.PIPE,
+                                  stderr=subprocess.STDOUT).communicate()[0]
+    finally:
+        summary = stop_host(proc)
+    elapsed = time.time() - start
+
+    for line in output.splitlines() + summary.splitlines():
+        if re.match(r'(Wrote|UART|uart|flash:)', line):
+            print '  ' + line
+    if 'Wrote ' not in output:
+        raise LoadTestError, 'loader failed:\n' + output
+
+    with open(image, 'rb') as fp:
+        data = fp.read()
+    generation, slot, contents = active_slot(flash, options.part)
+    if contents[:len(data)] != data:
+        raise LoadTestError, 'slot %s differs from %s' % ('AB'[slot], image)
+    print '  slot %s generation %d verified, %.1f s' % \
+          ('AB'[slot], generation, elapsed)
+
+
+if __name__ == "__main__":
+    from optparse import OptionParser
+
+    parser = OptionParser(usage='%prog [options] <image>')
+    parser.add_option("--host", dest="host",
+                      default=os.path.join(TOP, 'disconnect-host'),
+                      help="Host model binary [%default]")
+    parser.add_option("--loader", dest="loader",
+                      default='%s %s' % (sys.executable,
+                                         os.path.join(TOP, 'loader.py')),
+                      help="Loader command [%default]")
+    parser.add_option("-p", "--part", dest="part", default="at45db642",
+                      help="AT45 part [%default]")
+    parser.add_option("-r", "--runs", dest="runs", type="int", default=1,
+                      help="Loads in a row, alternating slots [%default]")
+    parser.add_option("-n", "--no-rts", dest="no_rts", default=False,
+                      action="store_true",
+                      help="Model ignores RTS, bytes arrive at line rate")
+    parser.add_option("-e", "--corrupt", dest="corrupt", type="int",
+                      default=0, help="Flip a bit in every Nth byte")
+    parser.add_option("-f", "--flash", dest="flash",
+                      help="Keep the flash image in this file")
+    options, args = parser.parse_args()
+    if len(args) != 1:
+        parser.error('image expected')
+
+    tmpdir = None
+    flash = options.flash
+    if not flash:
+        tmpdir = tempfile.mkdtemp()
+        flash = os.path.join(tmpdir, 'flash.img')
+
+    failed = 0
+    try:
+        for i in xrange(options.runs):
+            print 'run %d' % (i + 1)
+            try:
+                run(options, args[0], flash)
+            except LoadTestError, e:
+                print '  FAILED: %s' % e
+                failed += 1
+    finally:
+        if tmpdir:
+            shutil.rmtree(tmpdir)
+
+    print '%d of %d runs passed' % (options.runs - failed, options.runs)
+    sys.exit(failed != 0)
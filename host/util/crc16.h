@@ -0,0 +1,20 @@
+/* avr-libc _crc16_update() in C for the host build */
+#ifndef DISCONNECT_HOST_UTIL_CRC16_H
+#define DISCONNECT_HOST_UTIL_CRC16_H
+#include <stdint.h>
+
+static inline uint16_t _crc16_update(uint16_t crc, uint8_t a)
+{
+    int i;
+
+    crc ^= a;
+    for (i = 0; i < 8; i++) {
+        if (crc & 1)
+            crc = (crc >> 1) ^ 0xa001;
+        else
+            crc = crc >> 1;
+    }
+    return crc;
+}
+
+#endif /* DISCONNECT_HOST_UTIL_CRC16_H */
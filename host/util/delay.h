@@ -0,0 +1,10 @@
+/* Busy waits advance the model clock on the host */
+#ifndef DISCONNECT_HOST_UTIL_DELAY_H
+#define DISCONNECT_HOST_UTIL_DELAY_H
+
+void host_delay_us(double us);
+
+#define _delay_us(us) host_delay_us(us)
+#define _delay_ms(ms) host_delay_us((ms) * 1000.0)
+
+#endif /* DISCONNECT_HOST_UTIL_DELAY_H */
@@ -0,0 +1,31 @@
+/* Hot clip bank: sample heads kept in program memory */
+#ifndef DISCONNECT_HOT_H
+#define DISCONNECT_HOT_H
+#include <stdint.h>
+#include <avr/pgmspace.h>
+
+/*
+ * Bank sources are generated by `firmware.py --hot-bank <file.c>' for
+ * one image, whose header carries the same bank id. Clips are found by
+ * the AT45 address of their sample, cont is the raw address of the first
+ * byte after the clip (both relative to the content slot).
+ */
+typedef struct {
+    uint8_t addr[3];
+    uint8_t cont[3];
+    uint16_t length;
+    const uint8_t *data;
+} hot_clip_t;
+
+#ifndef pgm_read_ptr
+# define pgm_read_ptr(p) ((void *) pgm_read_word(p))
+#endif
+
+/* Clips are at least this long, the continuation read is sent meanwhile */
+#define HOT_CLIP_MIN 16
+
+extern const hot_clip_t hot_clips[] PROGMEM;
+extern const uint8_t hot_nr_clips;
+extern const uint16_t hot_bank_id; /* 0: empty bank */
+
+#endif /* DISCONNECT_HOT_H */
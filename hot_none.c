@@ -0,0 +1,8 @@
+/* Empty hot clip bank, see firmware.py --hot-bank */
+#include "hot.h"
+
+const hot_clip_t hot_clips[] PROGMEM = {
+    {{0, 0, 0}, {0, 0, 0}, 0, 0},
+};
+const uint8_t hot_nr_clips = 0;
+const uint16_t hot_bank_id = 0;
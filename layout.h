@@ -0,0 +1,91 @@
+/* AT45 flash layout */
+#ifndef DISCONNECT_LAYOUT_H
+#define DISCONNECT_LAYOUT_H
+#include <stdint.h>
+
+#include "at45.h"
+
+/*
+ * Pages 0 and 1 hold slot pointer records, the end of the flash is
+ * reserved for a staged MCU firmware image, the rest is split into two
+ * content slots A and B. Each slot holds a complete image, all page
+ * numbers inside an image are relative to its slot.
+ *
+ * With RECORD_REPLIES the recording area (record.h) takes the end of
+ * slot B. Slot bases don't depend on it, so images stay where firmware
+ * without the area put them.
+ */
+#define LAYOUT_POINTER_PAGES 2
+#define LAYOUT_NR_SLOTS      2
+
+#ifndef RECORD_REPLIES
+# define RECORD_REPLIES 1
+#endif
+
+/* Recordings get 1/LAYOUT_RECORD_SHARE of the pages */
+#define LAYOUT_RECORD_SHARE  8
+
+/* Application section of the atmega128, boot section excluded */
+#define LAYOUT_FIRMWARE_BYTES 0x1e000ul
+
+typedef struct {
+    uint8_t magic[2];       /* sp */
+    uint32_t generation;    /* highest valid one wins */
+    uint8_t slot;
+    uint16_t crc16;         /* of the fields above */
+} __attribute__((packed)) slot_pointer_t;
+
+/* Staged firmware: header page followed by the image */
+static inline
+uint16_t layout_firmware_pages()
+{
+    return 1 + (LAYOUT_FIRMWARE_BYTES + at45_page_size() - 1) /
+        at45_page_size();
+}
+
+static inline
+uint16_t layout_firmware_base()
+{
+    return at45_nr_pages() - layout_firmware_pages();
+}
+
+/* Recording area: catalog page followed by the sample ring */
+static inline
+uint16_t layout_record_pages()
+{
+#if RECORD_REPLIES
+    return at45_nr_pages() / LAYOUT_RECORD_SHARE;
+#else
+    return 0;
+#endif
+}
+
+static inline
+uint16_t layout_record_base()
+{
+    return layout_firmware_base() - layout_record_pages();
+}
+
+/* Distance between the slot bases */
+static inline
+uint16_t layout_slot_span()
+{
+    return (layout_firmware_base() - LAYOUT_POINTER_PAGES) / LAYOUT_NR_SLOTS;
+}
+
+static inline
+uint16_t layout_slot_base(uint8_t slot)
+{
+    return LAYOUT_POINTER_PAGES + slot * layout_slot_span();
+}
+
+/* Pages an image in the slot may use, slot B ends at the recordings */
+static inline
+uint16_t layout_slot_pages(uint8_t slot)
+{
+    if (slot == LAYOUT_NR_SLOTS - 1)
+        return layout_record_base() - layout_slot_base(slot);
+    return layout_slot_span();
+}
+
+#endif /* DISCONNECT_LAYOUT_H */
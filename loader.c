@@ -4,11 +4,18 @@
 
 #include <string.h>
 
+#include "hal.h"
 #include "timer.h"
 #include "uart.h"
 #include "at45.h"
 #include "power.h"
 #include "crc16.h"
+#include "fwupdate.h"
+#include "stream.h"
+#include "record.h"
+#include "layout.h"
+#include "dsp.h"
+#include "telemetry.h"
 
 #define TIMER_UART_TIMEOUT 0
 
@@ -18,8 +25,50 @@
   > write XXXX
   > <PAGE DATA>
   < OK|ERR
+  > info
+  < at45 <device id> <page size> <pages>
+  > upgrade
+  < ok, device resets and programs staged MCU firmware
+  > stats
+  < uart <overrun> <frame errors> <rx overflow> <tx dropped>
+  > baud XXXX
+  < ok, then the UART runs with UBRR = XXXX
+  > wake
+  < wake <deep power-down cycles> <rail cycles>, CPU cycles to first
+    flash byte after resume from deep power-down and after switching
+    the rail on
+  > stream XXXX
+  < ok, then IMA ADPCM bytes play with a sample every XXXX + 1 cycles
+  < fill <buffered bytes> <underruns>, repeated while playing
+  < stream <underruns> <overruns> <bytes lost> <max buffered>, once
+    nothing arrived for a second, then ok
+  > record XXXX
+  < ok, records from the microphone for XXXX seconds
+  < rec <seq> <first page> <samples, 32 bit> <rate> <dropped samples>
+  < ok
+  > recs
+  < recs <first ring page> <ring pages> <claimed>, 0 ring pages
+    without RECORD_REPLIES
+  < rec ..., for every recording in a claimed catalog, then ok
+  > recclear
+  < ok, all recordings are forgotten
+  > recclaim
+  < ok, the end of slot B becomes the recording area, empty
+  > dsp
+  < dsp <loop> <gain> <mix> <onepole> <fade> <biquad>, CPU cycles for
+    256 samples, every kernel includes the loop
+  > telemetry
+  < telemetry <seq> <counter>..., see enum telemetry_counter, including
+    counts not saved to the EEPROM yet
+  < event <id> <arg> <call>, for every logged event, oldest first
+  < ok
+  > telreset
+  < ok, counters and events are cleared in SRAM and EEPROM
  */
 
+/* Page data has to arrive within this many ticks */
+#define WRITE_PAGE_TIMEOUT (HZ * 2)
+
 static inline const char *parse_hex(const char *args,
                                     unsigned int *dest)
 {
@@ -66,7 +115,7 @@ static int uart_loader_read_page(const char *args)
 {
     unsigned int page;
     uint16_t crc = 0;
-    int off;
+    unsigned int off;
 
     if (NULL == parse_hex(args, &page)) {
         uart0_puts("ERROR: read <16bit hex>\r\n");
@@ -80,7 +129,7 @@ static int uart_loader_read_page(const char *args)
         return -1;
     }
 
-    for (off = 0; off < AT45_PAGE_SIZE; off++) {
+    for (off = 0; off < at45_page_size(); off++) {
         unsigned char c;
 
         c = at45_spi_read();
@@ -122,28 +171,36 @@ static int uart_loader_write_page(const char *args)
         return -1;
     }
 
+    timer_start_oneshot(TIMER_UART_TIMEOUT, WRITE_PAGE_TIMEOUT);
+
     for (i = 0; i < length; i++) {
         unsigned char c;
 
         while (!uart0_getc(&c)) {
-            /* TODO: handle timeout */
+            if (timer_read_event(TIMER_UART_TIMEOUT)) {
+                at45_write_page_abort();
+                uart0_puts("ERROR: timeout\r\n");
+                return -1;
+            }
         }
 
         at45_spi_write(c);
         crc2 = crc16_byte(crc2, c);
     }
 
-    if (at45_write_page_stop()) {
-        uart0_puts("ERROR: at45_write_page_stop() failed\r\n");
-        return -1;
-    }
-
+    /* page is only programmed with good data */
     if (crc != crc2) {
+        at45_write_page_abort();
         uart0_print_hex16(crc2);
         uart0_puts("ERROR: crc16 error\r\n");
         return -1;
     }
 
+    if (at45_write_page_stop()) {
+        uart0_puts("ERROR: at45_write_page_stop() failed\r\n");
+        return -1;
+    }
+
     uart0_puts("ok\r\n");
     return 0;
 usage:
@@ -151,6 +208,194 @@ usage:
     return -1;
 }
 
+static void uart_loader_info()
+{
+    uart0_puts("at45 ");
+    uart0_print_hex(at45_geometry.device_id);
+    uart0_putc(' ');
+    uart0_print_hex16(at45_page_size());
+    uart0_putc(' ');
+    uart0_print_hex16(at45_nr_pages());
+    uart0_puts("\r\n");
+}
+
+static void uart_loader_stats()
+{
+    uart0_puts("uart ");
+    uart0_print_hex16(uart0_rx_overrun);
+    uart0_putc(' ');
+    uart0_print_hex16(uart0_rx_frame_err);
+    uart0_putc(' ');
+    uart0_print_hex16(uart0_rx_overflow);
+    uart0_putc(' ');
+    uart0_print_hex16(uart0_tx_dropped);
+    uart0_puts("\r\n");
+}
+
+static void uart_loader_baud(const char *args)
+{
+    unsigned int ubrr;
+
+    if (NULL == parse_hex(args, &ubrr)) {
+        uart0_puts("ERROR: baud <ubrr hex>\r\n");
+        return;
+    }
+
+    uart0_puts("ok\r\n");
+    uart0_flush();
+    uart0_init(ubrr);
+}
+
+static void uart_loader_stream(const char *args)
+{
+    stream_stats_t stats;
+    unsigned int period;
+
+    if (NULL == parse_hex(args, &period) || period < STREAM_PERIOD_MIN) {
+        uart0_puts("ERROR: stream <period hex>\r\n");
+        return;
+    }
+
+    uart0_puts("ok\r\n");
+    stream_play(period, &stats);
+
+    uart0_puts("stream ");
+    uart0_print_hex16(stats.underruns);
+    uart0_putc(' ');
+    uart0_print_hex16(stats.overruns);
+    uart0_putc(' ');
+    uart0_print_hex16(stats.lost);
+    uart0_putc(' ');
+    uart0_print_hex16(stats.max_fill);
+    uart0_puts("\r\nok\r\n");
+
+    /* saved by the command loop, like after a call */
+    if (stats.underruns) {
+        telemetry_add(TELEMETRY_UNDERRUNS, stats.underruns);
+        telemetry_event(TELEMETRY_EV_UNDERRUN,
+                        stats.underruns > 0xff ? 0xff : stats.underruns);
+        telemetry_commit();
+    }
+}
+
+static void uart_loader_rec_entry(const rec_entry_t *entry)
+{
+    uart0_puts("rec ");
+    uart0_print_hex16(entry->seq);
+    uart0_putc(' ');
+    uart0_print_hex16(entry->start);
+    uart0_putc(' ');
+    uart0_print_hex16(entry->length >> 16);
+    uart0_print_hex16(entry->length & 0xffff);
+    uart0_putc(' ');
+    uart0_print_hex16(entry->rate);
+    uart0_putc(' ');
+    uart0_print_hex16(entry->dropped);
+    uart0_puts("\r\n");
+}
+
+static void uart_loader_record(const char *args)
+{
+    rec_entry_t entry;
+    unsigned int secs;
+
+    if (NULL == parse_hex(args, &secs) || !secs || secs > 0xffff / HZ) {
+        uart0_puts("ERROR: record <seconds hex>\r\n");
+        return;
+    }
+    if (!record_claimed()) {
+        uart0_puts("ERROR: recording area not claimed\r\n");
+        return;
+    }
+
+    uart0_puts("ok\r\n");
+    uart0_flush();
+    record_run(secs * HZ, NULL, &entry);
+    uart_loader_rec_entry(&entry);
+    uart0_puts("ok\r\n");
+}
+
+static void uart_loader_recs()
+{
+    uint8_t i, n = record_entries();
+    uint8_t claimed = record_claimed();
+    rec_entry_t entry;
+
+    uart0_puts("recs ");
+    uart0_print_hex16(layout_record_base() + 1);
+    uart0_putc(' ');
+    uart0_print_hex16(layout_record_pages() ? record_ring_pages() : 0);
+    uart0_putc(' ');
+    uart0_print_hex(claimed);
+    uart0_puts("\r\n");
+
+    for (i = 0; claimed && i < n; i++) {
+        if (!record_entry(i, &entry))
+            uart_loader_rec_entry(&entry);
+    }
+    uart0_puts("ok\r\n");
+}
+
+static void wake_timer_start()
+{
+    hal_timer1_start(1); /* clk/1 */
+}
+
+static unsigned int wake_timer_stop()
+{
+    at45_read_start(0);
+    at45_spi_read();
+    at45_read_stop();
+
+    hal_timer1_stop();
+    return hal_timer1_read();
+}
+
+static void uart_loader_wake()
+{
+    unsigned int dpd, rail;
+    unsigned char flags;
+
+    uart0_flush();
+    local_irq_save(flags);
+
+    at45_sleep();
+    wake_timer_start();
+    at45_wake();
+    dpd = wake_timer_stop();
+
+    /* the loader holds the rail, cycle it behind its back */
+    main_power_off();
+    at45_power_lost();
+    _delay_ms(10);
+    wake_timer_start();
+    main_power_on();
+    _delay_ms(RAIL_UP_MS);
+    rail = wake_timer_stop();
+
+    local_irq_restore(flags);
+
+    uart0_puts("wake ");
+    uart0_print_hex16(dpd);
+    uart0_putc(' ');
+    uart0_print_hex16(rail);
+    uart0_puts("\r\n");
+}
+
+static void uart_loader_upgrade()
+{
+    fwupdate_header_t header;
+
+    if (fwupdate_verify(&header) < 0) {
+        uart0_puts("ERROR: no valid firmware staged\r\n");
+        return;
+    }
+
+    uart0_puts("ok\r\n");
+    uart0_flush();
+    fwupdate_start(&header);
+}
+
 static void uart_loader_test()
 {
     unsigned int page;
@@ -160,9 +405,9 @@ static void uart_loader_test()
 
     cli();
     for (page = 0; page < 1000; page++) {
-        for (pos = 0; pos < AT45_PAGE_SIZE; pos++) {
+        for (pos = 0; pos < at45_page_size(); pos++) {
             unsigned char c = at45_spi_read();
-            PORTC = c;
+            hal_dac_write(c);
         }
     }
     sei();
@@ -176,6 +421,135 @@ static void uart_loader_test()
     uart0_puts("DONE\r\n");
 }
 
+/* Measure crc16_byte() speed of the compiled-in engine in CPU cycles */
+static void uart_loader_crc()
+{
+    uint16_t crc = 0;
+    uint16_t cycles;
+    unsigned int i;
+
+    cli();
+    hal_timer1_start(1); /* clk/1 */
+
+    for (i = 0; i < 256; i++)
+        crc = crc16_byte(crc, i);
+
+    hal_timer1_stop();
+    cycles = hal_timer1_read();
+    sei();
+
+    uart0_puts("crc16 engine ");
+    uart0_print_hex(CRC16_ENGINE);
+    uart0_puts(": ");
+    uart0_print_hex16(cycles);
+    uart0_puts(" cycles/256 bytes, crc ");
+    uart0_print_hex16(crc);
+    uart0_puts("\r\n");
+}
+
+enum {
+    DSP_LOOP,
+    DSP_GAIN,
+    DSP_MIX,
+    DSP_ONEPOLE,
+    DSP_FADE,
+    DSP_BIQUAD,
+    DSP_KERNELS,
+};
+
+static volatile int8_t dsp_sink;
+
+static uint16_t uart_loader_dsp_run(uint8_t kernel)
+{
+    dsp_onepole_t onepole = DSP_ONEPOLE(128);
+    /* Butterworth low-pass, 3.4 kHz at 20.8 kHz */
+    dsp_biquad_t biquad = DSP_BIQUAD(0.15, 0.30, 0.15, -0.6466, 0.2465);
+    dsp_fade_t fade;
+    uint16_t cycles;
+    unsigned int i;
+    int8_t x = 0;
+
+    dsp_fade_start(&fade, 255, 0, 256);
+
+    cli();
+    hal_timer1_start(1); /* clk/1 */
+
+    for (i = 0; i < 256; i++) {
+        int8_t y;
+
+        /* a sawtooth with some overflows for the mix */
+        x += 37;
+        switch (kernel) {
+        case DSP_GAIN:
+            y = dsp_gain(x, 180);
+            break;
+        case DSP_MIX:
+            y = dsp_mix(x, 64);
+            break;
+        case DSP_ONEPOLE:
+            y = dsp_onepole(&onepole, x);
+            break;
+        case DSP_FADE:
+            y = dsp_fade(&fade, x);
+            break;
+        case DSP_BIQUAD:
+            y = dsp_biquad(&biquad, x);
+            break;
+        default:
+            y = x;
+            break;
+        }
+        dsp_sink = y;
+    }
+
+    hal_timer1_stop();
+    cycles = hal_timer1_read();
+    sei();
+
+    return cycles;
+}
+
+static void uart_loader_dsp()
+{
+    uint8_t kernel;
+
+    uart0_puts("dsp");
+    for (kernel = 0; kernel < DSP_KERNELS; kernel++) {
+        uart0_putc(' ');
+        uart0_print_hex16(uart_loader_dsp_run(kernel));
+    }
+    uart0_puts("\r\n");
+}
+
+static void uart_loader_telemetry()
+{
+    telemetry_event_t *event;
+    uint8_t i;
+
+    uart0_puts("telemetry ");
+    uart0_print_hex16(telemetry.seq);
+    for (i = 0; i < TELEMETRY_COUNTERS; i++) {
+        uart0_putc(' ');
+        uart0_print_hex16(telemetry.counter[i]);
+    }
+    uart0_puts("\r\n");
+
+    for (i = 0; i < TELEMETRY_EVENTS; i++) {
+        event = &telemetry.event[(telemetry.events + i) &
+                                 (TELEMETRY_EVENTS - 1)];
+        if (event->id == TELEMETRY_EV_NONE)
+            continue;
+        uart0_puts("event ");
+        uart0_print_hex(event->id);
+        uart0_putc(' ');
+        uart0_print_hex(event->arg);
+        uart0_putc(' ');
+        uart0_print_hex16(event->call);
+        uart0_puts("\r\n");
+    }
+    uart0_puts("ok\r\n");
+}
+
 #define TIMER_RING_TIMEOUT 2
 
 static void uart_loader_ring()
@@ -186,9 +560,9 @@ static void uart_loader_ring()
     for (i = 0; i < 2; i++) {
         timer_start_oneshot(TIMER_RING_TIMEOUT, HZ + HZ / 2);
         while (!timer_read_event(TIMER_RING_TIMEOUT)) {
-            PORTG |= (1 << PG1);
+            hal_ring(1);
             _delay_us(30);
-            PORTG &= ~(1 << PG1);
+            hal_ring(0);
             _delay_us(30);
         }
 
@@ -210,13 +584,13 @@ static void uart_loader_zoom()
     while (!timer_read_event(TIMER_RING_TIMEOUT)) {
         int i;
         for (i = 0; i < 100; i++) {
-            PORTC = 0x80 - BEEP_VOLUME;
+            hal_dac_write(0x80 - BEEP_VOLUME);
             _delay_ms(1);
-            PORTC = 0x80;
+            hal_dac_write(0x80);
             _delay_ms(1);
-            PORTC = 0x80 + BEEP_VOLUME;
+            hal_dac_write(0x80 + BEEP_VOLUME);
             _delay_ms(1);
-            PORTC = 0x80;
+            hal_dac_write(0x80);
             _delay_ms(1);
         }
     }
@@ -232,13 +606,13 @@ static void uart_loader_busy()
 
     while (!timer_read_event(TIMER_RING_TIMEOUT)) {
         for (i = 0; i < 100; i++) {
-            PORTC = 0x80 - BEEP_VOLUME;
+            hal_dac_write(0x80 - BEEP_VOLUME);
             _delay_ms(1);
-            PORTC = 0x80;
+            hal_dac_write(0x80);
             _delay_ms(1);
-            PORTC = 0x80 + BEEP_VOLUME;
+            hal_dac_write(0x80 + BEEP_VOLUME);
             _delay_ms(1);
-            PORTC = 0x80;
+            hal_dac_write(0x80);
             _delay_ms(1);
         }
 
@@ -256,7 +630,7 @@ static void uart_loader_saw()
         int i;
 
         for (i = 0; i < 256; i++) {
-            PORTC = i;
+            hal_dac_write(i);
             _delay_us(1);
         }
     }
@@ -272,16 +646,13 @@ static void uart_loader_test_mic()
     timer_start_oneshot(TIMER_RING_TIMEOUT, HZ * 10);
 
     while (!timer_read_event(TIMER_RING_TIMEOUT)) {
-        unsigned char c = PINB & (1 << PB6);
+        unsigned char c = hal_mic();
 
         if (c != state) {
             state = c;
 
             if (c) {
-                if (PORTE & (1 << PE2))
-                    PORTE &= ~(1 << PE2);
-                else
-                    PORTE |= 1 << PE2;
+                hal_led(!hal_led_level());
             }
         }
     }
@@ -312,6 +683,44 @@ static int uart_loader_handle(const char *cmd)
         uart_loader_test();
     } else if (!strcmp(cmd, "mic")) {
         uart_loader_test_mic();
+    } else if (!strcmp(cmd, "info")) {
+        uart_loader_info();
+    } else if (!strcmp(cmd, "binary")) {
+        at45_set_binary_mode();
+        uart0_puts("ok\r\n");
+    } else if (!strcmp(cmd, "upgrade")) {
+        uart_loader_upgrade();
+    } else if (!strcmp(cmd, "crc")) {
+        uart_loader_crc();
+    } else if (!strcmp(cmd, "wake")) {
+        uart_loader_wake();
+    } else if (!strcmp(cmd, "stats")) {
+        uart_loader_stats();
+    } else if (!strncmp(cmd, "baud ", 5)) {
+        uart_loader_baud(cmd + 5);
+    } else if (!strncmp(cmd, "stream ", 7)) {
+        uart_loader_stream(cmd + 7);
+    } else if (!strncmp(cmd, "record ", 7)) {
+        uart_loader_record(cmd + 7);
+    } else if (!strcmp(cmd, "recs")) {
+        uart_loader_recs();
+    } else if (!strcmp(cmd, "dsp")) {
+        uart_loader_dsp();
+    } else if (!strcmp(cmd, "recclear")) {
+        if (record_clear())
+            uart0_puts("ERROR: recording area not claimed\r\n");
+        else
+            uart0_puts("ok\r\n");
+    } else if (!strcmp(cmd, "recclaim")) {
+        if (record_claim())
+            uart0_puts("ERROR: no recording area\r\n");
+        else
+            uart0_puts("ok\r\n");
+    } else if (!strcmp(cmd, "telemetry")) {
+        uart_loader_telemetry();
+    } else if (!strcmp(cmd, "telreset")) {
+        telemetry_reset();
+        uart0_puts("ok\r\n");
     } else {
         uart0_puts("ERROR: unknown command: '");
         uart0_puts(cmd);
@@ -326,9 +735,7 @@ void uart_loader()
     unsigned int pos = 0;
     char cmd[32];
 
-    main_power_on();
-
-    _delay_ms(1);
+    rail_get();
 
     timer_init();
     uart0_init(UART_BAUD(57600));
@@ -349,6 +756,8 @@ void uart_loader()
         if (timer_read_event(TIMER_UART_TIMEOUT))
             pos = 0;
 
+        telemetry_idle();
+
         if (uart0_getc(&c)) {
             timer_start_oneshot(TIMER_UART_TIMEOUT, HZ / 2);
 
@@ -368,4 +777,5 @@ void uart_loader()
     }
 
     uart0_reset();
+    rail_put();
 }
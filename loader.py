@@ -1,12 +1,20 @@
+import audioop
+import glob
+import mmap
 import os
 import sys
+import threading
 import time
 
 import serial
 import wave
 
+import tracedump
 from crc16 import crc16
-from firmware import FLASH_PAGE_SIZE, FLASH_PAGES
+from firmware import FLASH_PAGE_SIZE, FLASH_PAGES, GEOMETRIES, \
+     POINTER_PAGES, NR_SLOTS, FIRMWARE_BYTES, pad_page, \
+     parse_slot_pointer, slot_base, slot_pages, slot_pointer, \
+     firmware_base, firmware_header
 
 
 class LoaderError(Exception):
@@ -21,14 +29,47 @@ class LoaderCRCError(LoaderError):
     pass
 
 
+F_CPU = 1000000
+WRITE_RETRIES = 3
+
+# stream.h
+STREAM_BUF_SIZE = 1024
+STREAM_PREFILL = STREAM_BUF_SIZE / 2
+STREAM_RATE = 4000
+
+# telemetry.h
+TELEMETRY_COUNTERS = ('boots', 'calls', 'answered', 'ignored', 'pickups',
+                      'messages', 'hangups', 'recordings', 'rec_dropped',
+                      'underruns', 'slot_errors')
+TELEMETRY_EVENTS = {1: 'hung up after %d%% of the message',
+                    2: 'slot %d failed its checks',
+                    3: '%d recorded samples dropped',
+                    4: '%d stream underruns'}
+
+
+def parse_rec(line):
+    """`rec' reply line -> (seq, first page, samples, rate, dropped)"""
+    reply = line.split()
+    if len(reply) != 6 or reply[0] != 'rec':
+        raise LoaderError, "got %r instead of a recording" % line
+    return tuple(int(i, 16) for i in reply[1:])
+
+
 class Loader(object):
-    def __init__(self, device):
+    def __init__(self, device, rtscts=True):
+        self.device = device
         self.fp = serial.Serial(device,
                                 57600,
                                 bytesize=8,
                                 parity=serial.PARITY_NONE,
                                 stopbits=2,
-                                timeout=2)
+                                timeout=2,
+                                rtscts=rtscts)
+        self.page_size = FLASH_PAGE_SIZE
+        self.nr_pages = FLASH_PAGES
+        # write_page() statistics
+        self.pages_written = 0
+        self.retries = 0
 
     def version(self):
         self.fp.write('hi\r\n')
@@ -39,35 +80,225 @@ class Loader(object):
             raise LoaderSignatureError, "No DISCONNECT device found"
         return reply[1]
 
+    def geometry(self):
+        """Query flash geometry, returns (page size, number of pages)"""
+        self.fp.write('info\r\n')
+        self.fp.flush()
+        reply = self.fp.readline().split()
+        if len(reply) != 4 or reply[0] != 'at45':
+            raise LoaderError, "got %r for info command" % reply
+        device_id, page_size, nr_pages = [int(i, 16) for i in reply[1:]]
+        if device_id not in GEOMETRIES:
+            raise LoaderError, "unknown flash device id %02x" % device_id
+        self.page_size = page_size
+        self.nr_pages = nr_pages
+        return page_size, nr_pages
+
+    def set_binary_pages(self):
+        """Switch flash into power-of-two page mode (one-time)"""
+        self.custom('binary')
+        self.wait(5)
+
+    def stream(self, data, rate, report=None):
+        """Play IMA ADPCM data on the device at rate samples/s
+
+        Bytes are sent a prefill ahead of playback, RTS holds them off
+        when the device buffer is full. report(fill, underruns) gets the
+        buffer occupancy lines. Returns the device totals: underruns,
+        overruns, bytes lost and the highest buffer fill.
+        """
+        period = int(round(F_CPU / float(rate))) - 1
+        byte_rate = F_CPU / (period + 1.0) / 2
+        self.custom('stream %x' % period)
+        self.wait()
+
+        lines = ['']
+        result = []
+
+        def poll():
+            waiting = self.fp.inWaiting()
+            if not waiting:
+                return
+            lines[0] += self.fp.read(waiting)
+            while '\n' in lines[0]:
+                line, lines[0] = lines[0].split('\n', 1)
+                reply = line.split()
+                if len(reply) == 3 and reply[0] == 'fill':
+                    if report:
+                        report(int(reply[1], 16), int(reply[2], 16))
+                elif len(reply) == 5 and reply[0] == 'stream':
+                    result[:] = [int(i, 16) for i in reply[1:]]
+                elif reply != ['ok']:
+                    raise LoaderError, "got %r while streaming" % line
+
+        start = time.time()
+        sent = 0
+        while sent < len(data):
+            ahead = STREAM_PREFILL + (time.time() - start) * byte_rate
+            count = min(int(ahead) - sent, 64, len(data) - sent)
+            if count > 0:
+                self.fp.write(data[sent:sent + count])
+                sent += count
+            else:
+                time.sleep(0.01)
+            poll()
+
+        # the device plays out its buffer after a second of silence
+        deadline = time.time() + STREAM_BUF_SIZE / byte_rate + 3
+        while not result and time.time() < deadline:
+            time.sleep(0.05)
+            poll()
+        if not result:
+            raise LoaderError, "no stream summary"
+        return result
+
+    def stats(self):
+        """UART error counters: overrun, frame, rx overflow, tx dropped"""
+        self.custom('stats')
+        reply = self.fp.readline().split()
+        if len(reply) != 5 or reply[0] != 'uart':
+            raise LoaderError, "got %r for stats command" % reply
+        return [int(i, 16) for i in reply[1:]]
+
+    def wake_timing(self):
+        """CPU cycles to first flash byte: (deep power-down, rail)"""
+        self.custom('wake')
+        reply = self.fp.readline().split()
+        if len(reply) != 3 or reply[0] != 'wake':
+            raise LoaderError, "got %r for wake command" % reply
+        return [int(i, 16) for i in reply[1:]]
+
+    def record(self, seconds):
+        """Record from the microphone, returns the catalog entry"""
+        self.custom('record %x' % seconds)
+        self.wait()
+        self.fp.setTimeout(seconds + 5)
+        entry = parse_rec(self.fp.readline())
+        self.wait()
+        return entry
+
+    def recordings(self):
+        """(first ring page, ring pages, claimed, [catalog entries])
+
+        Ring pages are 0 for firmware without a recording area, including
+        firmware that doesn't know the recs command.
+        """
+        self.custom('recs')
+        self.fp.setTimeout(2)
+        line = self.fp.readline()
+        if line.startswith('ERROR'):
+            return 0, 0, False, []
+        reply = line.split()
+        if len(reply) != 4 or reply[0] != 'recs':
+            raise LoaderError, "got %r for recs command" % reply
+        entries = []
+        while True:
+            line = self.fp.readline()
+            if line == 'ok\r\n':
+                break
+            entries.append(parse_rec(line))
+        return int(reply[1], 16), int(reply[2], 16), reply[3] != '00', \
+               sorted(entries)
+
+    def telemetry(self):
+        """(seq, {counter: value}, [(event id, arg, call)]), oldest first"""
+        self.custom('telemetry')
+        self.fp.setTimeout(2)
+        reply = self.fp.readline().split()
+        if len(reply) != 2 + len(TELEMETRY_COUNTERS) or \
+           reply[0] != 'telemetry':
+            raise LoaderError, "got %r for telemetry command" % reply
+        counters = dict(zip(TELEMETRY_COUNTERS,
+                            [int(i, 16) for i in reply[2:]]))
+        events = []
+        while True:
+            line = self.fp.readline()
+            if line == 'ok\r\n':
+                break
+            event = line.split()
+            if len(event) != 4 or event[0] != 'event':
+                raise LoaderError, "got %r instead of an event" % line
+            events.append(tuple(int(i, 16) for i in event[1:]))
+        return int(reply[1], 16), counters, events
+
+    def dsp_timing(self):
+        """Cycles per sample of the dsp.h kernels, loop excluded"""
+        self.custom('dsp')
+        reply = self.fp.readline().split()
+        if len(reply) != 7 or reply[0] != 'dsp':
+            raise LoaderError, "got %r for dsp command" % reply
+        loop = int(reply[1], 16)
+        return [(int(i, 16) - loop) / 256.0 for i in reply[2:]]
+
+    def set_baud(self, baud):
+        """Switch both ends to the closest rate the device can do"""
+        ubrr = max(int(round(F_CPU / (8.0 * baud))) - 1, 0)
+        actual = F_CPU / (8.0 * (ubrr + 1))
+        if abs(actual - baud) / baud > 0.02:
+            self.log('Warning: device runs at %d baud for %d' % (actual, baud))
+        self.custom('baud %x' % ubrr)
+        self.wait()
+        self.fp.baudrate = baud
+
     def read_page(self, page):
         self.fp.write('read %x\r\n' % page)
         self.wait()
 
-        reply = self.fp.read(FLASH_PAGE_SIZE + 6)
-        if len(reply) != FLASH_PAGE_SIZE + 6:
+        reply = self.fp.read(self.page_size + 6)
+        if len(reply) != self.page_size + 6:
             raise LoaderError, \
                   "Reply to short for read command, length = %d" % len(reply)
-        data = reply[:FLASH_PAGE_SIZE]
-        crc = int(reply[FLASH_PAGE_SIZE:], 16)
+        data = reply[:self.page_size]
+        crc = int(reply[self.page_size:], 16)
 
         if crc16(data) != crc:
             raise LoaderCRCError, "CRC16 error"
         return data
 
     def write_page(self, page, data):
-        if len(data) > FLASH_PAGE_SIZE:
+        """Write page, retried on errors
+
+        The device only programs the page once the CRC matches, a failed
+        attempt leaves the old contents.
+        """
+        if len(data) > self.page_size:
             raise LoaderError, "data is larger than page size"
 
         crc = crc16(data)
-        self.fp.write('write %x %x %x\r\n' % (page, len(data), crc))
-        self.fp.write(data)
-        self.fp.flush()
-        self.wait()
+        for retry in xrange(WRITE_RETRIES):
+            self.fp.write('write %x %x %x\r\n' % (page, len(data), crc))
+            self.fp.write(data)
+            self.fp.flush()
+            try:
+                self.wait()
+                self.pages_written += 1
+                return
+            except LoaderError, e:
+                error = e
+            self.retries += 1
+            # leftovers of a broken page end up in the command parser
+            time.sleep(1)
+            self.fp.flushInput()
+        raise error
 
     def custom(self, cmd):
         self.fp.write("%s\r\n" % cmd)
         self.fp.flush()
 
+    def log(self, msg):
+        print msg
+
+    def stage(self, state):
+        """Called when flash_slot() starts writing or verifying"""
+        pass
+
+    def progress(self, done, total, written):
+        """Called after every page of flash_data() and verify_data()"""
+        sys.stdout.write(written and '.' or '_')
+        if done == total:
+            sys.stdout.write('\n')
+        sys.stdout.flush()
+
     def wait(self, timeout=2):
         """Wait for okay reply"""
         self.fp.setTimeout(timeout)
@@ -76,43 +307,302 @@ class Loader(object):
             raise LoaderError, "got %r instead of OK" % reply
 
 
+def adpcm_encode(fname, rate):
+    """WAV file to mono IMA ADPCM at rate, see adpcm.h"""
+    fp = wave.open(fname, 'rb')
+    width = fp.getsampwidth()
+    channels = fp.getnchannels()
+    src_rate = fp.getframerate()
+    frames = fp.readframes(fp.getnframes())
+    fp.close()
+
+    if width == 1:
+        # 8-bit WAV samples are unsigned
+        frames = audioop.bias(frames, 1, -128)
+    if channels == 2:
+        frames = audioop.tomono(frames, width, 0.5, 0.5)
+    elif channels != 1:
+        raise LoaderError, "%s: %d channels" % (fname, channels)
+    frames = audioop.lin2lin(frames, width, 2)
+    frames = audioop.ratecv(frames, 2, 1, src_rate, rate, None)[0]
+    return audioop.lin2adpcm(frames, 2, None)[0]
+
+
+def pull_recordings(loader, directory):
+    """Save every recording as rec-<seq>.wav, unsigned 8-bit mono"""
+    ring, ring_pages, claimed, entries = loader.recordings()
+    for seq, start, length, rate, dropped in entries:
+        pages = (length + loader.page_size - 1) / loader.page_size
+        data = ''.join(loader.read_page(ring + (start + i) % ring_pages)
+                       for i in xrange(pages))
+        fname = os.path.join(directory, 'rec-%d.wav' % seq)
+        fp = wave.open(fname, 'wb')
+        fp.setnchannels(1)
+        fp.setsampwidth(1)
+        fp.setframerate(rate)
+        fp.writeframes(data[:length])
+        fp.close()
+        loader.log('%s: %.1f s, %d samples dropped' %
+                   (fname, float(length) / rate, dropped))
+    return len(entries)
+
+
 def test_hardware(loader):
-    print 'Writing to flash'
-    data = os.urandom(FLASH_PAGE_SIZE)
-    loader.write_page(FLASH_PAGES - 1, data)
+    loader.log('Writing to flash')
+    data = os.urandom(loader.page_size)
+    loader.write_page(loader.nr_pages - 1, data)
 
-    print 'Reading from flash'
-    rdata = loader.read_page(FLASH_PAGES - 1)
+    loader.log('Reading from flash')
+    rdata = loader.read_page(loader.nr_pages - 1)
 
     if data != rdata:
         raise LoaderError, "data mismatch"
 
-    print 'Testing speaker with "saw"'
+    loader.log('Testing speaker with "saw"')
     loader.custom('saw')
     loader.wait(5)
 
-    print 'Testing beeper'
+    loader.log('Testing beeper')
     loader.custom('zoom')
     loader.wait(5)
 
-    print 'Testing busy beeper'
+    loader.log('Testing busy beeper')
     loader.custom('busy')
     loader.wait(5)
 
-    print 'Testing ring'
+    loader.log('Testing ring')
     loader.custom('ring')
     loader.wait(8)
 
 
-def flash_data(loader, data, page_no=0):
-    while data:
-        page = data[:FLASH_PAGE_SIZE]
-        data = data[FLASH_PAGE_SIZE:]
-        loader.write_page(page_no, page)
-        page_no += 1
-        sys.stdout.write('.')
-        sys.stdout.flush()
-    sys.stdout.write('\n')
+def flash_data(loader, data, page_no=0, base=None):
+    """Write image, pages equal to those of base image are skipped"""
+    if len(data) % loader.page_size:
+        raise LoaderError, "image is not built for %d-byte pages" % \
+              loader.page_size
+    base = base or ''
+    total = len(data) / loader.page_size
+    for i in xrange(total):
+        offset = i * loader.page_size
+        page = data[offset:offset + loader.page_size]
+        written = page != base[offset:offset + loader.page_size]
+        if written:
+            loader.write_page(page_no + i, page)
+        loader.progress(i + 1, total, written)
+
+
+def verify_data(loader, data, page_no=0):
+    """Read the image back, raises LoaderError on the first difference"""
+    total = len(data) / loader.page_size
+    for i in xrange(total):
+        offset = i * loader.page_size
+        if loader.read_page(page_no + i) != \
+           data[offset:offset + loader.page_size]:
+            raise LoaderError, "page %d differs" % (page_no + i)
+        loader.progress(i + 1, total, True)
+
+
+def flash_slot(loader, data, base=None, verify=False):
+    """Write image into the inactive slot, then switch to it
+
+    The new pointer record goes to the page holding the older one, so an
+    interrupted update, or with verify an image that doesn't read back,
+    leaves the old content active. An image in slot B must end before the
+    recording area, which is claimed once it does.
+    """
+    records = []
+    for page in xrange(POINTER_PAGES):
+        pointer = parse_slot_pointer(loader.read_page(page))
+        if pointer:
+            records.append(pointer + (page,))
+
+    if records:
+        generation, active, page = max(records)
+        slot = active ^ 1
+        pointer_page = (page + 1) % POINTER_PAGES
+    else:
+        generation, slot, pointer_page = 0, 0, 0
+
+    ring, ring_pages, claimed, entries = loader.recordings()
+    pages = slot_pages(slot, loader.nr_pages, loader.page_size,
+                       ring_pages > 0)
+    if len(data) > pages * loader.page_size:
+        raise LoaderError, "image doesn't fit slot %s, %d pages" % \
+              ('AB'[slot], pages)
+
+    loader.log('Writing slot %s' % 'AB'[slot])
+    loader.stage('writing')
+    flash_data(loader, data,
+               slot_base(slot, loader.nr_pages, loader.page_size), base)
+    if verify:
+        loader.stage('verifying')
+        verify_data(loader, data,
+                    slot_base(slot, loader.nr_pages, loader.page_size))
+
+    if slot == NR_SLOTS - 1 and ring_pages and not claimed:
+        loader.log('Claiming the recording area')
+        loader.custom('recclaim')
+        loader.wait()
+
+    loader.write_page(pointer_page,
+                      pad_page(slot_pointer(generation + 1, slot),
+                               loader.page_size))
+    loader.log('Slot %s active, generation %d' % ('AB'[slot], generation + 1))
+    return slot
+
+
+def update_mcu(loader, image):
+    """Stage MCU firmware in the AT45 and let the boot section program it"""
+    if len(image) > FIRMWARE_BYTES:
+        raise LoaderError, "firmware is larger than application section"
+
+    base = firmware_base(loader.nr_pages, loader.page_size)
+    loader.log('Staging %d bytes of firmware' % len(image))
+    flash_data(loader, pad_page(image, loader.page_size), base + 1)
+    # header last, the staged image is only valid once complete
+    loader.write_page(base, pad_page(firmware_header(image),
+                                     loader.page_size))
+
+    loader.log('Verifying and rebooting')
+    loader.custom('upgrade')
+    loader.wait(60)
+
+
+class Provisioner(threading.Thread):
+    """Load, verify and optionally test one device of a batch
+
+    Any error ends this device only; the rest of the batch goes on.
+    """
+    def __init__(self, device, data, options, output):
+        threading.Thread.__init__(self, name=device)
+        self.daemon = True
+        self.device = device
+        self.data = data
+        self.options = options
+        self.output = output
+        self.loader = None
+        self.state = 'connecting'
+        self.done = self.total = 0
+        self.error = None
+        self.start_time = self.elapsed = 0
+        self.pages = self.retries = 0
+
+    def log(self, msg):
+        self.output(self.device, msg)
+
+    def progress(self, done, total, written):
+        self.done, self.total = done, total
+
+    def stage(self, state):
+        self.state = state
+
+    def run(self):
+        options = self.options
+        self.start_time = time.time()
+        try:
+            loader = Loader(self.device, options.rtscts)
+            loader.log = self.log
+            loader.progress = self.progress
+            loader.stage = self.stage
+            self.loader = loader
+
+            self.log('version %r' % loader.version())
+            if options.baud:
+                loader.set_baud(options.baud)
+            loader.geometry()
+
+            flash_slot(loader, self.data, options.base_data, options.verify)
+            if options.hwtest:
+                self.state = 'testing'
+                test_hardware(loader)
+            self.state = 'ok'
+        except Exception, e:
+            if not self.error:
+                self.error = e
+            self.state = 'FAILED'
+        self.elapsed = time.time() - self.start_time
+        if self.loader:
+            self.pages = self.loader.pages_written
+            self.retries = self.loader.retries
+            self.loader.fp.close()
+
+    def abort(self, why):
+        """Give up on a stalled device, closing the port ends its I/O"""
+        self.error = why
+        if self.loader:
+            self.loader.fp.close()
+
+    def status(self):
+        if self.state in ('writing', 'verifying') and self.total:
+            return '%s %d%%' % (self.state, 100 * self.done / self.total)
+        return self.state
+
+
+def expand_ports(specs):
+    """Comma-separated ports or globs, in sorted order"""
+    ports = []
+    for spec in specs.split(','):
+        matches = sorted(glob.glob(spec)) if glob.has_magic(spec) else [spec]
+        for port in matches:
+            if port not in ports:
+                ports.append(port)
+    return ports
+
+
+def provision(ports, data, options):
+    """Run a Provisioner per port, returns the number of failed devices"""
+    lock = threading.Lock()
+    tty = sys.stdout.isatty()
+
+    def output(device, msg):
+        with lock:
+            if tty:
+                sys.stdout.write('\r\033[K')
+            print '%s: %s' % (device, msg)
+
+    workers = [Provisioner(port, data, options, output) for port in ports]
+    start = time.time()
+    for worker in workers:
+        worker.start()
+
+    last = 0
+    while any(worker.is_alive() for worker in workers):
+        time.sleep(0.5)
+        now = time.time()
+        for worker in workers:
+            if options.timeout and worker.is_alive() and not worker.error \
+               and now - worker.start_time > options.timeout:
+                worker.abort(LoaderError('timed out'))
+        line = '  '.join('%s %s' % (os.path.basename(worker.device),
+                                    worker.status()) for worker in workers)
+        with lock:
+            if tty:
+                sys.stdout.write('\r\033[K' + line[:160])
+                sys.stdout.flush()
+            elif now - last >= 10:
+                print line
+                last = now
+    elapsed = time.time() - start
+    if tty:
+        sys.stdout.write('\r\033[K')
+
+    print '%-20s %-8s %6s %7s %8s %8s' % ('device', 'result', 'pages',
+                                          'retries', 'seconds', 'bytes/s')
+    failed = pages = 0
+    for worker in workers:
+        page_size = worker.loader and worker.loader.page_size or 0
+        print '%-20s %-8s %6d %7d %8.1f %8d' % \
+              (worker.device, worker.state, worker.pages, worker.retries,
+               worker.elapsed,
+               worker.pages * page_size / max(worker.elapsed, 0.001))
+        if worker.error:
+            print '    %s' % worker.error
+        if worker.state != 'ok':
+            failed += 1
+        pages += worker.pages * page_size
+    print '%d of %d devices ok in %.1f s, %d bytes/s in total' % \
+          (len(workers) - failed, len(workers), elapsed, pages / elapsed)
+    return failed
 
 
 if __name__ == "__main__":
@@ -128,27 +618,185 @@ if __name__ == "__main__":
                       action="store_true", help="Enter normal operation mode")
     parser.add_option("--monitor", dest="monitor", default=False,
                       action="store_true", help="Enter monitor mode")
+    parser.add_option("--mcu", dest="mcu",
+                      help="Update MCU firmware (application .bin file)")
+    parser.add_option("--binary-pages", dest="binary_pages", default=False,
+                      action="store_true",
+                      help="Switch flash to power-of-two pages (irreversible)")
     parser.add_option("-l", "--load", dest="firmware",
                       help="Flash firmware file")
+    parser.add_option("-b", "--base", dest="base",
+                      help="Image already in the inactive slot, only "
+                      "changed pages are written")
+    parser.add_option("--baud", dest="baud", type="int",
+                      help="Switch to this baud rate after connecting")
+    parser.add_option("--no-rtscts", dest="rtscts", default=True,
+                      action="store_false",
+                      help="Device built with UART_FLOW_RTS=0")
+    parser.add_option("--wake-timing", dest="wake_timing", default=False,
+                      action="store_true",
+                      help="Measure flash wakeup from deep power-down "
+                      "and from rail off")
+    parser.add_option("--dsp-timing", dest="dsp_timing", default=False,
+                      action="store_true",
+                      help="Measure the cycles per sample of the DSP kernels")
+    parser.add_option("--stats", dest="stats", default=False,
+                      action="store_true",
+                      help="Print UART error counters when done")
+
+    parser.add_option("--stream", dest="stream",
+                      help="Play a WAV file through the speaker live")
+    parser.add_option("--stream-rate", dest="stream_rate", type="int",
+                      default=STREAM_RATE,
+                      help="Sample rate for --stream (default %default)")
+    parser.add_option("--record", dest="record", type="int",
+                      help="Record from the microphone for this many seconds")
+    parser.add_option("--recordings", dest="recordings", default=False,
+                      action="store_true",
+                      help="List the recordings kept by the device")
+    parser.add_option("--pull", dest="pull",
+                      help="Save recordings as WAV files into this directory")
+    parser.add_option("--clear-recordings", dest="clear_recordings",
+                      default=False, action="store_true",
+                      help="Forget all recordings")
+    parser.add_option("--telemetry", dest="telemetry", default=False,
+                      action="store_true",
+                      help="Print the call counters and event log")
+    parser.add_option("--reset-telemetry", dest="reset_telemetry",
+                      default=False, action="store_true",
+                      help="Clear the call counters and event log")
+    parser.add_option("--provision", dest="provision",
+                      help="Load -l into all these ports at once, a comma "
+                      "separated list of ports or globs")
+    parser.add_option("--no-verify", dest="verify", default=True,
+                      action="store_false",
+                      help="Don't read the image back before switching "
+                      "slots with --provision")
+    parser.add_option("--timeout", dest="timeout", type="float",
+                      help="Give up on a --provision device after this "
+                      "many seconds")
 
     (options, args) = parser.parse_args()
 
-    loader = Loader(options.device)
+    if options.provision:
+        if not options.firmware:
+            parser.error('--provision needs -l')
+        ports = expand_ports(options.provision)
+        if not ports:
+            parser.error('no ports match %s' % options.provision)
+        # one read-only mapping shared by every device
+        with open(options.firmware, 'rb') as fp:
+            data = mmap.mmap(fp.fileno(), 0, access=mmap.ACCESS_READ)
+        options.base_data = None
+        if options.base:
+            with open(options.base, 'rb') as fp:
+                options.base_data = fp.read()
+        sys.exit(provision(ports, data, options) != 0)
+
+    loader = Loader(options.device, options.rtscts)
     version = loader.version()
 
     print 'DISCONNECT device version %r found' % version
 
-    if options.hwtest:
+    if options.baud:
+        loader.set_baud(options.baud)
+
+    page_size, nr_pages = loader.geometry()
+    print 'Flash: %d pages of %d bytes' % (nr_pages, page_size)
+
+    if options.binary_pages:
+        loader.set_binary_pages()
+        print 'Binary page mode set, power cycle the device'
+    elif options.mcu:
+        with open(options.mcu, 'rb') as fp:
+            update_mcu(loader, fp.read())
+    elif options.hwtest:
         test_hardware(loader)
+    elif options.wake_timing:
+        dpd, rail = loader.wake_timing()
+        print 'Flash wakeup: deep power-down %d us, rail %d us' % \
+              (dpd * 1000000 / F_CPU, rail * 1000000 / F_CPU)
+    elif options.dsp_timing:
+        for name, cycles in zip(('gain', 'mix', 'onepole', 'fade', 'biquad'),
+                                loader.dsp_timing()):
+            print '%-8s %5.1f cycles/sample' % (name, cycles)
+    elif options.stream:
+        data = adpcm_encode(options.stream, options.stream_rate)
+        ms_per_byte = 2000.0 / options.stream_rate
+
+        def report(fill, underruns):
+            sys.stdout.write('\rbuffer %4d bytes %5d ms, underruns %d ' %
+                             (fill, fill * ms_per_byte, underruns))
+            sys.stdout.flush()
+
+        print 'Streaming %d bytes, %.1f s' % (len(data),
+                                              len(data) * ms_per_byte / 1000)
+        underruns, overruns, lost, max_fill = \
+            loader.stream(data, options.stream_rate, report)
+        print '\nStream: %d underruns, %d overruns, %d bytes lost, ' \
+              'at most %d bytes buffered' % (underruns, overruns, lost,
+                                             max_fill)
+    elif options.record:
+        print 'Recording for %d s' % options.record
+        seq, start, length, rate, dropped = loader.record(options.record)
+        print 'Recording %d: %d samples at %d Hz from page %d, ' \
+              '%d samples dropped' % (seq, length, rate, start, dropped)
+    elif options.recordings:
+        ring, ring_pages, claimed, entries = loader.recordings()
+        if not ring_pages:
+            print 'No recording area'
+        elif not claimed:
+            print 'Recording area not claimed, load an image into slot B'
+        else:
+            print 'Recording area: %d pages from page %d' % (ring_pages,
+                                                             ring)
+        for seq, start, length, rate, dropped in entries:
+            print '  %5d: %6.1f s at page %d, %d samples dropped' % \
+                  (seq, float(length) / rate, start, dropped)
+    elif options.pull:
+        print '%d recordings saved' % pull_recordings(loader, options.pull)
+    elif options.clear_recordings:
+        loader.custom('recclear')
+        loader.wait()
+        print 'Recordings cleared'
+    elif options.telemetry:
+        seq, counters, events = loader.telemetry()
+        print 'Telemetry record %d' % seq
+        for name in TELEMETRY_COUNTERS:
+            print '  %-12s %5d' % (name, counters[name])
+        for id, arg, call in events:
+            print '  call %5d: %s' % \
+                  (call, TELEMETRY_EVENTS.get(id, 'event %d, %%d' % id) % arg)
+    elif options.reset_telemetry:
+        loader.custom('telreset')
+        loader.wait()
+        print 'Telemetry cleared'
     elif options.go:
         loader.custom('go')
+        # normal mode reinitializes the UART at the default rate
+        loader.fp.flush()
+        time.sleep(0.1)
+        loader.fp.baudrate = 57600
     elif options.firmware:
         with open(options.firmware, 'rb') as fp:
             data = fp.read()
-        flash_data(loader, data)
+        base = None
+        if options.base:
+            with open(options.base, 'rb') as fp:
+                base = fp.read()
+        start = time.time()
+        flash_slot(loader, data, base)
+        elapsed = time.time() - start
+        print 'Wrote %d pages in %.1f s, %d bytes/s, %d retries' % \
+              (loader.pages_written, elapsed,
+               loader.pages_written * loader.page_size / elapsed,
+               loader.retries)
+
+    if options.stats and not options.go:
+        print 'UART overrun %d, frame errors %d, rx overflow %d, ' \
+              'tx dropped %d' % tuple(loader.stats())
 
     if options.monitor:
         loader.fp.setTimeout(None)
-        while True:
-            reply = loader.fp.readline()
-            sys.stdout.write(reply)
+        tracedump.dump(loader.fp, sys.stdout, histograms=[
+            tracedump.Histogram('TRACE_HOOK_AUDIO', 'us')])
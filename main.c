@@ -2,40 +2,38 @@
 #include <avr/interrupt.h>
 #include <util/delay.h>
 
-#include <stdio.h> /* NULL */
-#include <stdlib.h> /* rand */
+#include <stdlib.h> /* random */
+#include <stddef.h> /* offsetof */
 
+#include "hal.h"
 #include "timer.h"
 #include "uart.h"
 #include "at45.h"
 #include "crc16.h"
 #include "loader.h"
+#include "layout.h"
 #include "power.h"
+#include "trace.h"
+#include "clock.h"
+#include "hot.h"
+#include "record.h"
+#include "telemetry.h"
+
+/*
+ * make DEBUG=1: trace events go out over the UART while waiting for the
+ * hook. 57600 baud keeps the clock undivided, see clock_idle().
+ */
+#ifndef DEBUG
+# define DEBUG 0
+#endif
 
-#define DEBUG
-
-#ifdef DEBUG
-static int __dbg_putchar(char c, FILE *stream)
-{
-    static char p = 0;
-    (void) stream;
-    if (c == '\n' && p != '\r')
-        uart0_putc('\r');
-    p = c;
-    uart0_putc(c);
-    return 0;
-}
-
-static FILE __dbg_fp = FDEV_SETUP_STREAM(
-    __dbg_putchar, NULL, _FDEV_SETUP_WRITE);
-
-#define dbg_printf(fmt, args...) fprintf(&__dbg_fp, fmt, ## args)
+#if DEBUG
+#define trace_idle() trace_drain()
 #else
-#define dbg_printf(fmt, ...) do {} while (0)
+#define trace_idle() do {} while (0)
 #endif
 
 #define TIMER_MISC 0
-#define MAX_SAMPLES 16
 
 
 /* Settings */
@@ -51,22 +49,6 @@ static FILE __dbg_fp = FDEV_SETUP_STREAM(
 #define USER_WAIT_TIMEOUT  (2 * HZ)
 
 
-typedef struct {
-    uint8_t signature[4]; /* v1\r\n */
-    uint8_t samples;
-    uint16_t crc16;
-} header_t;
-
-typedef struct {
-    unsigned char role;
-    unsigned char weight;
-    unsigned char repeat;
-    uint16_t page;
-    uint16_t pages;
-    uint16_t odd;
-} __attribute__((packed)) sample_t;
-
-
 enum Role {
     ROLE_INCOMING = 0,
     ROLE_BUSY,
@@ -76,16 +58,79 @@ enum Role {
 } ;
 
 typedef struct {
-    sample_t *samples[MAX_SAMPLES];
-    unsigned int count;
-    unsigned int weight;
-} role_set_t;
+    uint16_t first;     /* first catalog slot */
+    uint16_t count;
+} __attribute__((packed)) role_range_t;
+
+typedef struct {
+    uint8_t signature[4]; /* v4\r\n */
+    uint16_t page_size; /* image is laid out for this page size */
+    uint16_t catalog_page;
+    uint16_t catalog_slots;
+    uint16_t catalog_crc16;
+    role_range_t roles[ROLE_MAX];
+    uint16_t hot_id;    /* hot clip bank built for this image, 0: none */
+    uint16_t crc16;     /* of the fields above */
+} __attribute__((packed)) header_t;
+
+/*
+ * Samples may start at any byte, addr is the raw AT45 address.
+ * With SAMPLE_EXTENTS set in repeat addr points to a list of
+ * extent_t covering length bytes instead. SAMPLE_HOT marks samples
+ * whose head is also in the hot clip bank, see hot.h.
+ */
+typedef struct {
+    unsigned char repeat;
+    uint8_t addr[3];
+    uint8_t length[3];
+} __attribute__((packed)) sample_t;
+
+#define SAMPLE_EXTENTS 0x80
+#define SAMPLE_HOT     0x40
+#define SAMPLE_REPEAT(s) ((s)->repeat & ~(SAMPLE_EXTENTS | SAMPLE_HOT))
+
+typedef struct {
+    uint16_t page;
+    uint16_t pages;
+} __attribute__((packed)) extent_t;
+
+#define EXTENT_WINDOW 8
+
+/* Sequential reader over a sample's contiguous runs */
+typedef struct {
+    uint32_t length;        /* bytes left */
+    uint32_t run;           /* bytes left in current run */
+    uint32_t addr;          /* contiguous sample address */
+    uint16_t list_page;     /* next extent_t to fetch */
+    uint16_t list_offset;
+    uint16_t ready;         /* primed: bytes readable without seeking */
+    uint8_t extents;
+    uint8_t pos;
+    extent_t window[EXTENT_WINDOW];
+} sample_stream_t;
+
+static inline uint32_t get_le24(const uint8_t *p)
+{
+    return p[0] | ((uint16_t) p[1] << 8) | ((uint32_t) p[2] << 16);
+}
 
-static role_set_t roles[ROLE_MAX];
+/*
+ * Catalog slot, one Walker alias table entry. Slot k of a role is
+ * taken with probability threshold / 65536, otherwise its alias.
+ * Page sizes are multiples of the slot size, so slots never cross pages.
+ */
+typedef struct {
+    uint16_t threshold;
+    sample_t sample;
+    sample_t alias;
+} __attribute__((packed)) catalog_slot_t;
 
+#define CATALOG_SLOT_SIZE 16
 
-static sample_t all_samples[MAX_SAMPLES];
-static unsigned char samples_count;
+static role_range_t roles[ROLE_MAX];
+static uint16_t catalog_page;
+static uint16_t slot_base;      /* first page of the active slot */
+static uint8_t hot_enabled;     /* image and hot bank match */
 
 
 #define PANIC_FLASH_ERROR 3
@@ -97,12 +142,16 @@ static void panic(int n)
     int i, j;
 
     cli();
+#if DEBUG
+    trace(TRACE_PANIC, n, 0);
+    trace_flush();
+#endif
     while (1) {
         for (j = 0; j < n; j++) {
             for (i = 0; i < 1000; i++) {
-                PORTG |= (1 << PG1);
+                hal_ring(1);
                 _delay_us(30);
-                PORTG &= ~(1 << PG1);
+                hal_ring(0);
                 _delay_us(30);
             }
             _delay_ms(200);
@@ -115,79 +164,262 @@ static void panic(int n)
 static inline int
 random_range(int left, int right)
 {
-    return rand() % (right - left) + left;
+    return random() % (right - left) + left;
 }
 
-static int phone_read_header()
+static int catalog_read_slot(unsigned int slot, catalog_slot_t *dest)
+{
+    unsigned int per_page = at45_page_size() / CATALOG_SLOT_SIZE;
+    uint8_t *ptr = (uint8_t *) dest;
+    unsigned int i;
+
+    if (at45_read_start_at(slot_base + catalog_page + slot / per_page,
+                           (slot % per_page) * CATALOG_SLOT_SIZE))
+        return -1;
+
+    for (i = 0; i < sizeof(catalog_slot_t); i++)
+        ptr[i] = at45_spi_read();
+    at45_read_stop();
+
+    return 0;
+}
+
+/*
+ * Validate image header and catalog of the slot starting at base,
+ * only role ranges are kept in SRAM.
+ */
+static int phone_read_slot(uint16_t base)
 {
     header_t header;
     uint8_t *ptr;
-    unsigned i;
+    unsigned long i, len;
     uint16_t crc = 0;
-    unsigned int len;
+    unsigned int r;
 
-    at45_read_start(0);
+    if (at45_read_start(base))
+        return -1;
 
     ptr = (uint8_t *) &header;
     for (i = 0; i < sizeof(header_t); i++) {
         ptr[i] = at45_spi_read();
+        if (i < offsetof(header_t, crc16))
+            crc = crc16_byte(crc, ptr[i]);
     }
+    at45_read_stop();
 
-    if (header.signature[0] != 'v'  || header.signature[1] != '1' ||
+    if (header.signature[0] != 'v'  || header.signature[1] != '4' ||
         header.signature[2] != '\r' || header.signature[3] != '\n')
-        goto error;
-
-    if (header.samples > MAX_SAMPLES)
-        goto error;
+        return -1;
 
-    samples_count = header.samples;
+    if (crc != header.crc16)
+        return -1;
 
-    ptr = (uint8_t *) &all_samples;
-    len = samples_count * sizeof(sample_t);
+    if (header.page_size != at45_page_size())
+        return -1;
 
-    for (i = 0; i < len; i++) {
-        unsigned char c = at45_spi_read();
-        crc = crc16_byte(crc, c);
-        ptr[i] = c;
+    for (r = 0; r < ROLE_MAX; r++) {
+        if ((unsigned long) header.roles[r].first + header.roles[r].count >
+            header.catalog_slots)
+            return -1;
     }
+
+    /* Catalog slots are contiguous in flash */
+    if (at45_read_start(base + header.catalog_page))
+        return -1;
+
+    crc = 0;
+    len = (unsigned long) header.catalog_slots * CATALOG_SLOT_SIZE;
+    for (i = 0; i < len; i++)
+        crc = crc16_byte(crc, at45_spi_read());
     at45_read_stop();
 
-    if (crc != header.crc16) {
+    if (crc != header.catalog_crc16)
         return -1;
-    }
 
+    slot_base = base;
+    catalog_page = header.catalog_page;
+    hot_enabled = header.hot_id && header.hot_id == hot_bank_id;
+    for (r = 0; r < ROLE_MAX; r++)
+        roles[r] = header.roles[r];
 
-    for (i = 0; i < samples_count; i++) {
-        sample_t *sample = &all_samples[i];
-        role_set_t *role;
+    return 0;
+}
 
-        if (!sample->weight)
-            sample->weight = 1;
-        if (sample->role >= ROLE_MAX)
-            continue; /* die here? */
+static int slot_pointer_read(uint16_t page, slot_pointer_t *pointer)
+{
+    uint8_t *ptr = (uint8_t *) pointer;
+    uint16_t crc = 0;
+    unsigned int i;
 
-        role = &roles[sample->role];
-        role->samples[role->count++] = sample;
-        role->weight += sample->weight;
+    at45_read_start(page);
+    for (i = 0; i < sizeof(slot_pointer_t); i++) {
+        ptr[i] = at45_spi_read();
+        if (i < offsetof(slot_pointer_t, crc16))
+            crc = crc16_byte(crc, ptr[i]);
     }
+    at45_read_stop();
 
+    if (pointer->magic[0] != 's' || pointer->magic[1] != 'p' ||
+        pointer->slot >= LAYOUT_NR_SLOTS || crc != pointer->crc16)
+        return -1;
     return 0;
-error:
-    at45_read_stop();
+}
+
+/*
+ * Use the slot of the newest valid pointer record, fall back to the
+ * other slot if its image doesn't pass CRC checks.
+ */
+static int phone_read_header()
+{
+    slot_pointer_t pointer, other;
+    uint8_t slot = 0;
+
+    if (slot_pointer_read(0, &pointer)) {
+        if (!slot_pointer_read(1, &pointer))
+            slot = pointer.slot;
+    } else {
+        slot = pointer.slot;
+        if (!slot_pointer_read(1, &other) &&
+            other.generation > pointer.generation)
+            slot = other.slot;
+    }
+
+    if (!phone_read_slot(layout_slot_base(slot)))
+        return 0;
+    telemetry_count(TELEMETRY_SLOT_ERRORS);
+    telemetry_event(TELEMETRY_EV_SLOT, slot);
+
+    if (!phone_read_slot(layout_slot_base(slot ^ 1)))
+        return 0;
+    telemetry_count(TELEMETRY_SLOT_ERRORS);
+    telemetry_event(TELEMETRY_EV_SLOT, slot ^ 1);
     return -1;
 }
 
 static inline char phone_hang()
 {
-    if (PINB & (1 << PB5))
+    if (hal_hook())
         return 1;
     return 0;
 }
 
+static void sample_stream_open(sample_stream_t *s, const sample_t *sample)
+{
+    s->length = get_le24(sample->length);
+    s->run = 0;
+    s->ready = 0;
+    s->addr = get_le24(sample->addr) +
+        ((uint32_t) slot_base << at45_geometry.page_shift);
+    s->extents = sample->repeat & SAMPLE_EXTENTS;
+    s->pos = EXTENT_WINDOW;
+
+    if (s->extents) {
+        uint8_t shift = at45_geometry.page_shift;
+
+        s->list_page = s->addr >> shift;
+        s->list_offset = s->addr & ((1u << shift) - 1);
+    }
+}
+
+/* Fetch next window of the extent list, entries never cross pages */
+static int sample_stream_fetch(sample_stream_t *s)
+{
+    uint8_t *ptr = (uint8_t *) s->window;
+    unsigned int i;
+
+    if (at45_read_start_at(s->list_page, s->list_offset))
+        return -1;
+
+    for (i = 0; i < sizeof(s->window); i++) {
+        ptr[i] = at45_spi_read();
+        if (i % sizeof(extent_t) == sizeof(extent_t) - 1) {
+            s->list_offset += sizeof(extent_t);
+            if (s->list_offset >= at45_page_size()) {
+                s->list_offset = 0;
+                s->list_page++;
+            }
+        }
+    }
+    at45_read_stop();
+
+    s->pos = 0;
+    return 0;
+}
+
+/* Position continuous read at the start of the next run */
+static int sample_stream_seek(sample_stream_t *s)
+{
+    extent_t *extent;
+
+    at45_read_stop();
+
+    if (!s->extents) {
+        s->run = s->length;
+        return at45_read_start_addr(s->addr);
+    }
+
+    if (s->pos == EXTENT_WINDOW && sample_stream_fetch(s))
+        return -1;
+
+    extent = &s->window[s->pos++];
+    s->run = (uint32_t) extent->pages * at45_page_size();
+    return at45_read_start(slot_base + extent->page);
+}
+
+/*
+ * Returns number of bytes that can be read from SPI now, at most one
+ * page, 0 at the end of sample. Reading is restarted only at run
+ * boundaries.
+ */
+static unsigned int sample_stream_next(sample_stream_t *s)
+{
+    unsigned int count = at45_page_size();
+
+    if (s->ready) {
+        count = s->ready;
+        s->ready = 0;
+        return count;
+    }
+
+    if (!s->length)
+        return 0;
+
+    if (!s->run && sample_stream_seek(s)) {
+        s->length = 0;
+        return 0;
+    }
+
+    if (count > s->run)
+        count = s->run;
+    if (count > s->length)
+        count = s->length;
+
+    s->run -= count;
+    s->length -= count;
+    return count;
+}
+
+static inline void sample_stream_close(sample_stream_t *s)
+{
+    s->ready = 0;
+    at45_read_stop();
+}
+
+/*
+ * Open and position the continuous read ahead of time, the first
+ * sample_stream_next() then returns without touching the flash.
+ * The read stays selected until the stream is closed.
+ */
+static void sample_stream_prime(sample_stream_t *s, const sample_t *sample)
+{
+    sample_stream_open(s, sample);
+    s->ready = sample_stream_next(s);
+}
+
 static inline int phone_play_some(int count)
 {
     while (count--) {
-        PORTC = at45_spi_read();
+        hal_dac_write(at45_spi_read());
         if (phone_hang())
             return -1;
     }
@@ -195,24 +427,127 @@ static inline int phone_play_some(int count)
     return 0;
 }
 
+static const hot_clip_t *hot_find(const sample_t *sample)
+{
+    uint8_t i;
+
+    if (!hot_enabled || (sample->repeat & (SAMPLE_EXTENTS | SAMPLE_HOT)) !=
+        SAMPLE_HOT)
+        return 0;
+
+    for (i = 0; i < hot_nr_clips; i++) {
+        const hot_clip_t *clip = &hot_clips[i];
+
+        if (pgm_read_byte(&clip->addr[0]) == sample->addr[0] &&
+            pgm_read_byte(&clip->addr[1]) == sample->addr[1] &&
+            pgm_read_byte(&clip->addr[2]) == sample->addr[2])
+            return clip;
+    }
+    return 0;
+}
+
+/*
+ * One sample of a hot clip head. The steps after SPIF are the ones of
+ * phone_play_some(): read SPDR, write the DAC, check the hook; the
+ * program memory read happens while the byte is on the wire.
+ */
+static inline char phone_play_hot_byte(uint8_t out, const uint8_t *p)
+{
+    uint8_t c;
+
+    hal_spi_start(out);
+    c = pgm_read_byte(p);
+    hal_spi_wait();
+    (void) hal_spi_data();
+    hal_dac_write(c);
+    return phone_hang();
+}
+
+/*
+ * Play the head of a sample from program memory. SPI keeps clocking
+ * with the flash deselected so the SPI transfer paces the bytes as it
+ * does from the AT45; the read command for the rest of the sample goes
+ * out with the last four bytes, the stream then continues from the
+ * flash. On hang up *left is set to the head bytes not played, the
+ * stream length doesn't count them any more.
+ */
+static int phone_play_hot(sample_stream_t *s, const hot_clip_t *clip,
+                          uint16_t *left)
+{
+    const uint8_t *data = pgm_read_ptr(&clip->data);
+    uint16_t len = pgm_read_word(&clip->length);
+    const uint8_t *end;
+    uint16_t count;
+    uint32_t cont;
+
+    if (len > s->length)
+        len = s->length;
+    s->length -= len;
+    s->run = s->length;
+    end = data + len;
+
+    /* nothing left on flash: don't select, keep clocking dummies */
+    count = s->length ? len - 4 : len;
+    while (count--) {
+        if (phone_play_hot_byte(0, data++))
+            goto hang;
+    }
+    if (!s->length)
+        return 0;
+
+    cont = ((uint32_t) pgm_read_byte(&clip->cont[2]) << 16) |
+        ((uint16_t) pgm_read_byte(&clip->cont[1]) << 8) |
+        pgm_read_byte(&clip->cont[0]);
+    cont += (uint32_t) slot_base << at45_geometry.page_shift;
+
+    at45_select();
+    if (phone_play_hot_byte(AT45_OP_READ, data++) ||
+        phone_play_hot_byte(cont >> 16, data++) ||
+        phone_play_hot_byte(cont >> 8, data++) ||
+        phone_play_hot_byte(cont, data++))
+        goto hang;
+
+    return 0;
+hang:
+    *left = end - data;
+    return -1;
+}
+
+/* Bytes of the last sample not played when the handset was hung up */
+static uint32_t play_left;
+
 static int phone_play_sample(sample_t *sample)
 {
+    sample_stream_t stream;
+    const hot_clip_t *clip;
+    unsigned int count;
+    uint16_t head_left;
     int retval = 0;
-    unsigned i;
 
     cli();
-    at45_read_start(sample->page);
-    phone_play_some(sample->odd);
+    sample_stream_open(&stream, sample);
 
-    for (i = 0; i < sample->pages; i++) {
-        if (phone_play_some(AT45_PAGE_SIZE)) {
+    clip = hot_find(sample);
+    if (clip && phone_play_hot(&stream, clip, &head_left)) {
+        play_left = stream.length + head_left;
+        stream.length = 0;
+        retval = -1;
+    }
+
+    /* keep the inner loop 16-bit, it sets the sample rate */
+    while ((count = sample_stream_next(&stream))) {
+        if (phone_play_some(count)) {
+            play_left = stream.length;
             retval = -1;
             break;
         }
     }
-    at45_read_stop();
+    sample_stream_close(&stream);
     sei();
 
+    trace(TRACE_PLAY, get_le24(sample->addr) >> at45_geometry.page_shift,
+          retval != 0);
+
     return retval;
 }
 
@@ -222,17 +557,17 @@ int phone_busy()
     int i, j;
 
     for (i = 0; i < BUSY_TIMES; i++) {
-        if (PINB & (1 << PB5))
+        if (hal_hook())
             break;
 
         for (j = 0; j < 100; j++) {
-            PORTC = 0x80 - BEEP_VOLUME;
+            hal_dac_write(0x80 - BEEP_VOLUME);
             _delay_ms(1);
-            PORTC = 0x80;
+            hal_dac_write(0x80);
             _delay_ms(1);
-            PORTC = 0x80 + BEEP_VOLUME;
+            hal_dac_write(0x80 + BEEP_VOLUME);
             _delay_ms(1);
-            PORTC = 0x80;
+            hal_dac_write(0x80);
             _delay_ms(1);
         }
 
@@ -248,6 +583,54 @@ enum {
     RING_ACCEPT,
 } ;
 
+/* Timer1 at clk/64 measures wakeup to first ring, see TRACE_WAKE */
+static inline void wake_mark()
+{
+    hal_timer1_start(3);
+}
+
+static inline void wake_stop()
+{
+    hal_timer1_stop();
+}
+
+static void wake_report()
+{
+    uint32_t us;
+
+    if (!hal_timer1_running())
+        return;
+
+    us = (uint32_t) hal_timer1_read() * (64 * 1000000ul / F_CPU);
+    wake_stop();
+    trace(TRACE_WAKE, us / 1000, us % 1000);
+}
+
+/*
+ * Hook-off to first audio byte: Timer1 at clk/8 runs free while
+ * ringing, the hook interrupt stamps the edge (hook_stamp).
+ */
+static inline void latency_start()
+{
+    hal_timer1_start(2);
+    hook_irq_arm(0);
+}
+
+static void latency_report()
+{
+    unsigned int counts = hal_timer1_read() - hook_stamp;
+    uint32_t us;
+
+    hook_irq_disarm();
+    if (!hal_timer1_running() || !hook_event)
+        return;
+
+    wake_stop();
+    /* saturates, the trace argument is 16-bit */
+    us = (uint32_t) counts * (8 * 1000000ul / F_CPU);
+    trace(TRACE_HOOK_AUDIO, us > 0xffff ? 0xffff : us, 0);
+}
+
 int phone_ring(int count)
 {
     int i;
@@ -256,9 +639,9 @@ int phone_ring(int count)
         timer_start_oneshot(TIMER_MISC, HZ + HZ / 2);
         while (!timer_read_event(TIMER_MISC) && phone_hang()) {
             /* ~30Khz */
-            PORTG |= (1 << PG1);
+            hal_ring(1);
             _delay_us(30);
-            PORTG &= ~(1 << PG1);
+            hal_ring(0);
             _delay_us(30);
         }
 
@@ -267,34 +650,70 @@ int phone_ring(int count)
             ;
     }
 
-    PORTG |= (1 << PG1);
+    hal_ring(1);
     return phone_hang();
 }
 
+/*
+ * Weighted choice: one random draw picks a slot of the role's alias
+ * table and the coin deciding between the slot and its alias.
+ */
 static
-sample_t *choose_sample(enum Role role)
+int choose_sample(enum Role role, sample_t *sample)
 {
-    role_set_t *set;
-    unsigned int r;
-    unsigned int i;
+    role_range_t *range;
+    catalog_slot_t slot;
+    unsigned long r;
+    uint16_t coin;
 
     if (role >= ROLE_MAX)
-        return NULL;
+        return -1;
 
-    set = &roles[role];
+    range = &roles[role];
 
-    if (set->count == 0)
-        return NULL;
+    if (range->count == 0)
+        return -1;
+
+    r = random();
+    coin = r / range->count;
+
+    if (catalog_read_slot(range->first + r % range->count, &slot))
+        return -1;
 
-    r = rand() % set->weight;
+    if (coin < slot.threshold)
+        *sample = slot.sample;
+    else
+        *sample = slot.alias;
 
-    for (i = 0; i < set->count; i++) {
-        if (set->samples[i]->weight > r)
-            return set->samples[i];
-        r -= set->samples[i]->weight;
+    return 0;
+}
+
+
+/* Next sample of every role, chosen while the flash is awake anyway */
+static sample_t armed[ROLE_MAX];
+static uint8_t armed_roles;
+
+static void phone_arm()
+{
+    unsigned int r;
+
+    for (r = 0; r < ROLE_MAX; r++) {
+        if (armed_roles & (1 << r))
+            continue;
+        if (!choose_sample(r, &armed[r]))
+            armed_roles |= 1 << r;
     }
+}
 
-    return NULL;
+static int take_sample(enum Role role, sample_t *sample)
+{
+    if (armed_roles & (1 << role)) {
+        *sample = armed[role];
+        armed_roles &= ~(1 << role);
+        return 0;
+    }
+
+    return choose_sample(role, sample);
 }
 
 
@@ -310,13 +729,13 @@ static int phone_call(int count)
         }
 
         for (i = 0; i < 100; i++) {
-            PORTC = 0x80 - BEEP_VOLUME_READY;
+            hal_dac_write(0x80 - BEEP_VOLUME_READY);
             _delay_us(500);
-            PORTC = 0x80;
+            hal_dac_write(0x80);
             _delay_us(500);
-            PORTC = 0x80 + BEEP_VOLUME_READY;
+            hal_dac_write(0x80 + BEEP_VOLUME_READY);
             _delay_us(500);
-            PORTC = 0x80;
+            hal_dac_write(0x80);
             _delay_us(500);
         }
     }
@@ -331,14 +750,12 @@ hang:
 static
 int phone_action_busy()
 {
-    sample_t *sample_music;
-    sample_t *sample_message;
+    sample_t sample_music;
+    sample_t sample_message;
     int j, i;
 
-    sample_message = choose_sample(ROLE_BUSY);
-    sample_music = choose_sample(ROLE_MUSIC);
-
-    if (!sample_message || !sample_music)
+    if (take_sample(ROLE_BUSY, &sample_message) ||
+        take_sample(ROLE_MUSIC, &sample_music))
         return -1;
 
     timer_start_oneshot(TIMER_MISC, HZ / 2);
@@ -353,11 +770,11 @@ int phone_action_busy()
         return 0;
 
     for (j = 0; j < 10; j++) {
-        if (phone_play_sample(sample_message))
+        if (phone_play_sample(&sample_message))
             return 0;
 
-        for (i = 0; i < sample_music->repeat; i++) {
-            if (phone_play_sample(sample_music))
+        for (i = 0; i < SAMPLE_REPEAT(&sample_music); i++) {
+            if (phone_play_sample(&sample_music))
                 return 0;
         }
     }
@@ -370,68 +787,144 @@ static void prnd_init()
     static int initialized = 0;
 
     if (!initialized) {
-        srand(ticks);
+        srandom(ticks);
         initialized = 1;
     }
 }
 
-/* Wait until user action or timeout */
+/*
+ * Wait until user action or timeout playing noise, stream is primed
+ * with the noise sample.
+ */
 static
-int phone_wait_user(int timeout)
+int phone_wait_user(int timeout, const sample_t *sample,
+                    sample_stream_t *stream)
 {
-    sample_t *sample = choose_sample(ROLE_NOISE);
-    unsigned long i, length;
-    unsigned char old = PINB & (1 << PB6);
+    unsigned int i, count;
+    unsigned char old = hal_mic();
     int changes = 0;
 
-    if (!sample)
-        return 0;
+    /* first byte goes out right away, the rest follows the loop */
+    if (stream->ready) {
+        hal_dac_write(at45_spi_read());
+        stream->ready--;
+        latency_report();
+    }
 
-    length = sample->odd + sample->pages * AT45_PAGE_SIZE;
     timer_start_oneshot(TIMER_MISC, timeout);
 
     while (1) {
-        at45_read_start(sample->page);
-        for (i = 0; i < length; i++) {
-            if (timer_read_event(TIMER_MISC) || phone_hang() || changes > 40)
-                goto done;
-
-            PORTC = at45_spi_read();
-            if (old ^ (PINB & (1 << PB6))) {
-                old = PINB & (1 << PB6);
-                changes++;
+        if (timer_read_event(TIMER_MISC) || phone_hang())
+            goto done;
+
+        while ((count = sample_stream_next(stream))) {
+            for (i = 0; i < count; i++) {
+                if (timer_read_event(TIMER_MISC) || phone_hang() ||
+                    changes > 40)
+                    goto done;
+
+                hal_dac_write(at45_spi_read());
+                if (old ^ hal_mic()) {
+                    old = hal_mic();
+                    changes++;
+                }
             }
         }
-        at45_read_stop();
+        sample_stream_close(stream);
+        sample_stream_open(stream, sample);
     }
 
 done:
     timer_stop(TIMER_MISC);
-    at45_read_stop();
+    sample_stream_close(stream);
     return phone_hang();
 }
 
 
+#if RECORD_REPLIES
+static int phone_record_stop()
+{
+    return phone_hang();
+}
+
+/*
+ * Record whatever the caller says after the message, until hang-up or
+ * REC_MAX. Returns nonzero if the caller hung up.
+ */
 static
-int phone_action_message()
+int phone_record_reply()
+{
+    rec_entry_t entry;
+
+    if (record_run(REC_MAX, phone_record_stop, &entry))
+        return phone_hang();
+    trace(TRACE_RECORD, entry.seq, entry.dropped);
+    telemetry_count(TELEMETRY_RECORDINGS);
+    if (entry.dropped) {
+        telemetry_add(TELEMETRY_REC_DROPPED, entry.dropped);
+        telemetry_event(TELEMETRY_EV_REC_DROPPED,
+                        entry.dropped > 0xff ? 0xff : entry.dropped);
+    }
+    return phone_hang();
+}
+#endif
+
+/* Percentage of the sample played before phone_play_sample() failed */
+static uint8_t played_percent(const sample_t *sample)
 {
-    sample_t *sample;
+    uint32_t length = get_le24(sample->length);
 
-    sample = choose_sample(ROLE_INCOMING);
+    if (!length || play_left > length)
+        return 0;
+    return (length - play_left) * 100 / length;
+}
 
-    if (!sample)
+static
+int phone_action_message()
+{
+    sample_t sample, noise;
+    sample_stream_t stream;
+
+    if (take_sample(ROLE_INCOMING, &sample))
         return -1;
 
+    /* the noise read is positioned while ringing */
+    if (take_sample(ROLE_NOISE, &noise) || !get_le24(noise.length)) {
+        noise.length[0] = noise.length[1] = noise.length[2] = 0;
+        stream.ready = 0;
+    } else {
+        sample_stream_prime(&stream, &noise);
+    }
+
+    /* ringing starts right after, Timer1 is reused from here on */
+    wake_report();
+    latency_start();
+    telemetry_count(TELEMETRY_CALLS);
     if (phone_ring (random_range(CALL_RING_MIN,
-                                 CALL_RING_MAX)))
+                                 CALL_RING_MAX))) {
+        sample_stream_close(&stream);
+        telemetry_count(TELEMETRY_IGNORED);
         return -1;
+    }
+    telemetry_count(TELEMETRY_ANSWERED);
     prnd_init();
 
-    if (phone_wait_user(USER_WAIT_TIMEOUT))
+    if (get_le24(noise.length) &&
+        phone_wait_user(USER_WAIT_TIMEOUT, &noise, &stream))
         return -1;
+    hook_irq_disarm();
 
-    if (phone_play_sample(sample))
+    if (phone_play_sample(&sample)) {
+        telemetry_count(TELEMETRY_HANGUPS);
+        telemetry_event(TELEMETRY_EV_HANGUP, played_percent(&sample));
         return -1;
+    }
+    telemetry_count(TELEMETRY_MESSAGES);
+
+#if RECORD_REPLIES
+    if (phone_record_reply())
+        return -1;
+#endif
 
     return phone_busy();
 }
@@ -455,71 +948,107 @@ int main()
 
     //PB5, PB6 - HANG
 
-    PORTE &= ~(1 << PE7);
+    main_power_on();
+    telemetry_init();
 
-    if (PINB & (1 << PB4)) {
+    if (hal_com()) {
         uart_loader();
         cli();
     }
 
-#ifdef DEBUG
+#if DEBUG
     uart0_init(UART_BAUD(57600));
-    dbg_printf("running phone in debug mode...\r\n");
 #endif
 
     timer_init();
     timer_enable();
 
-    main_power_on();
-    _delay_ms(1);
+    rail_get(); /* playback */
+#if FLASH_KEEP_RAIL
+    rail_get(); /* flash, deep power-down between calls */
+#endif
 
     if (at45_init()) {
         panic(PANIC_FLASH_ERROR);
     }
 
     if (phone_read_header()) {
+        telemetry_commit();
+        telemetry_flush();
         panic(PANIC_BAD_HEADER);
     }
 
+    trace(TRACE_BOOT, slot_base, 0);
     sei();
 
     /* main loop */
     while (1) {
         int timeout;
 
-        old_secs = seconds;
         timer_stop_all();
-        main_power_off();
-
+        wake_stop();
+        hook_irq_disarm();
+        phone_arm();
+        at45_sleep();
+        rail_put();
+
+        /* nothing to time, power-down until the handset is back */
+        hook_irq_arm(1);
         while (!phone_hang()) {
-            power_down();
+            trace_idle();
+            telemetry_idle();
+            clock_idle();
+            standby(0);
+            hook_event = 0;
         }
 
+        /*
+         * The tick stops in power-down, seconds only runs from here on:
+         * a handset lifted again before the next second gets the zoom,
+         * later the busy message.
+         */
+        old_secs = seconds;
+
         timeout = random_range(CALL_TIMEOUT_MIN,
                                CALL_TIMEOUT_MAX);
         timer_start_oneshot(TIMER_MISC, timeout);
 
-        dbg_printf("Sleeping for at least %d ticks\n", timeout);
+        trace(TRACE_SLEEP, timeout, 0);
 
+        hook_irq_arm(0);
         while (phone_hang() &&
                !timer_read_event(TIMER_MISC)) {
-            power_down();
+            trace_idle();
+            telemetry_idle();
+            clock_idle();
+            standby(1);
+            hook_event = 0;
         }
+        hook_irq_disarm();
 
-        main_power_on();
+        clock_full();
+        wake_mark();
+        rail_get();
+        at45_wake();
         timer_stop_all();
-        _delay_ms(1); /* let at45 wakeup */
 
         if (phone_hang()) {
-            dbg_printf("Incoming call\n");
+            trace(TRACE_CALL_INCOMING, 0, 0);
             phone_action_message();
         } else {
+            telemetry_count(TELEMETRY_PICKUPS);
             if (seconds == old_secs){
+                trace(TRACE_CALL_ZOOM, 0, 0);
                 phone_busy();
             } else {
-                dbg_printf("Service busy message\n");
+                trace(TRACE_CALL_BUSY, 0, 0);
                 phone_action_busy();
             }
         }
+
+        /* the call is over, saved while waiting for the next one */
+        telemetry_commit();
+        trace(TRACE_TELEMETRY, telemetry.seq,
+              telemetry.counter[TELEMETRY_CALLS]);
     }
 }
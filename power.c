@@ -0,0 +1,40 @@
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <util/delay.h>
+
+#include "power.h"
+#include "at45.h"
+
+volatile unsigned char hook_event;
+volatile unsigned int hook_stamp;
+unsigned char rail_users;
+
+void rail_get()
+{
+    if (rail_users++)
+        return;
+
+    main_power_on();
+    _delay_ms(RAIL_UP_MS);
+}
+
+void rail_put()
+{
+    if (!rail_users || --rail_users)
+        return;
+
+    main_power_off();
+    at45_power_lost();
+}
+
+/*
+ * Wakes the chip, the wait loops check the hook themselves. The first
+ * edge after hook_irq_arm() is timestamped with Timer1 for latency
+ * measurements.
+ */
+SIGNAL(SIG_INTERRUPT2)
+{
+    if (!hook_event)
+        hook_stamp = hal_timer1_read();
+    hook_event = 1;
+}
@@ -4,7 +4,43 @@
 #include <avr/interrupt.h>
 #include <avr/sleep.h>
 
+#include "hal.h"
 #include "irq.h"
+#include "timer.h"
+#include "uart.h"
+
+/*
+ * The hook contact (PB5) is wired to INT2 (PD2) as well, INT3:0 edges are
+ * detected without a clock and wake the chip from power-down.
+ */
+#define HOOK_INT_DDR   DDRD
+#define HOOK_INT_BIT   PD2
+
+extern volatile unsigned char hook_event;
+extern volatile unsigned int hook_stamp; /* TCNT1 at the first edge */
+
+/*
+ * Keep the rail up between calls and put the AT45 into deep power-down
+ * instead, wakeup takes AT45_RESUME_US rather than RAIL_UP_MS. Off by
+ * default: PE7 powers the speaker amplifier too, which would stay on
+ * through the idle minutes between calls.
+ */
+#ifndef FLASH_KEEP_RAIL
+# define FLASH_KEEP_RAIL 0
+#endif
+
+/* Rail on to first flash command, existing value, not from a datasheet */
+#define RAIL_UP_MS 1
+
+/**
+ * Speaker and flash share the PE7 rail. Users (playback, the loader and
+ * with FLASH_KEEP_RAIL the flash itself) hold a reference while they
+ * need it, the rail is off when nobody does.
+ */
+void rail_get();
+void rail_put();
+
+extern unsigned char rail_users;
 
 static inline
 void power_down()
@@ -13,28 +49,92 @@ void power_down()
 
     local_irq_save(flags);
     /* switch off leds */
-    PORTE |= (1 << PE2);
-    PORTG |= (1 << PG1);
+    hal_led(1);
+    hal_ring(1);
 
     /* switch off speaker power */
-    PORTE |= (1 << PE7);
+    if (!rail_users)
+        hal_rail(1);
 
-    set_sleep_mode(SLEEP_MODE_IDLE);
     local_irq_restore(flags);
 
-    sleep_mode();
+    hal_sleep(SLEEP_MODE_IDLE);
+}
+
+/**
+ * Arm the hook interrupt for the edge a wait loop is waiting for:
+ * rising when the handset goes on hook, falling when it is lifted.
+ * Loop with hook_event cleared before checking the hook, standby()
+ * returns at once if the edge came in between.
+ */
+static inline
+void hook_irq_arm(unsigned char rising)
+{
+    HOOK_INT_DDR &= ~(1 << HOOK_INT_BIT);
+    hal_hook_irq_disable();
+    hal_hook_irq_edge(rising);
+    hook_event = 0;
+    hal_hook_irq_enable();
+}
+
+static inline
+void hook_irq_disarm()
+{
+    hal_hook_irq_disable();
+}
+
+/**
+ * Sleep deeper than power_down() until the hook interrupt or, with
+ * ticking set, the next timer tick. Ticks need Timer0 on the crystal
+ * (TIMER_ASYNC) for power-save, otherwise the chip idles as before.
+ * Without ticking the chip powers down and timer ticks stop.
+ */
+static inline
+void standby(unsigned char ticking)
+{
+    unsigned char mode = SLEEP_MODE_PWR_DOWN;
+
+    /* switch off leds and speaker power */
+    hal_led(1);
+    hal_ring(1);
+    if (!rail_users)
+        hal_rail(1);
+
+    if (ticking)
+        mode = TIMER_ASYNC ? SLEEP_MODE_PWR_SAVE : SLEEP_MODE_IDLE;
+
+    /* the uart stops in the deep modes */
+    if ((UCSR0B & (1 << TXEN)) && !uart0_tx_idle())
+        mode = SLEEP_MODE_IDLE;
+
+#if TIMER_ASYNC
+    /*
+     * The asynchronous timer needs one TOSC1 cycle after wakeup before
+     * power-save may be entered again, a register write forces the wait.
+     */
+    if (mode == SLEEP_MODE_PWR_SAVE) {
+        OCR0 = OCR0;
+        while (ASSR & (1 << OCR0UB))
+            ;
+    }
+#endif
+
+    cli();
+    if (!hook_event)
+        hal_sleep_sei(mode);
+    sei();
 }
 
 static inline
 void main_power_on()
 {
-    PORTE &= ~(1 << PE7);
+    hal_rail(0);
 }
 
 static inline
 void main_power_off()
 {
-    PORTE |= (1 << PE7);
+    hal_rail(1);
 }
 
 #endif /* DISCONNECT_POWER_H */
@@ -0,0 +1,298 @@
+#include <stddef.h> /* offsetof */
+#include <string.h>
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <util/delay.h>
+
+#include "hal.h"
+#include "at45.h"
+#include "crc16.h"
+#include "layout.h"
+#include "record.h"
+
+static volatile uint8_t rec_buf[2][REC_CHUNK];
+static volatile uint8_t rec_full[2];    /* set by the vector, cleared by main */
+static volatile uint8_t rec_cur;        /* chunk the vector fills */
+static volatile uint8_t rec_pos;        /* next sample in it */
+static volatile uint16_t rec_dropped;
+
+/* Page writer, main loop only */
+static struct {
+    uint16_t ring;          /* first page of the ring, absolute */
+    uint16_t ring_pages;
+    uint16_t page;          /* being filled, relative */
+    uint16_t col;
+    uint16_t pages;         /* programmed so far */
+    uint8_t buf;            /* AT45 buffer being filled */
+    uint32_t length;
+} rec;
+
+SIGNAL(SIG_OUTPUT_COMPARE2)
+{
+    uint8_t cur = rec_cur;
+    uint8_t pos = rec_pos;
+    uint8_t v = hal_adc_read();
+
+    hal_adc_convert();
+
+    if (rec_full[cur]) {
+        rec_dropped++;
+        return;
+    }
+
+    rec_buf[cur][pos++] = v;
+    if (pos == REC_CHUNK) {
+        pos = 0;
+        rec_full[cur] = 1;
+        rec_cur = cur ^ 1;
+    }
+    rec_pos = pos;
+}
+
+/* Catalog entry i follows the area header */
+static uint16_t rec_offset(uint8_t i)
+{
+    return (i + 1) * sizeof(rec_entry_t);
+}
+
+uint8_t record_entries()
+{
+    return at45_page_size() / sizeof(rec_entry_t) - 1;
+}
+
+uint16_t record_ring_pages()
+{
+    return layout_record_pages() - 1;
+}
+
+static uint16_t rec_pages(uint32_t length)
+{
+    return (length + at45_page_size() - 1) / at45_page_size();
+}
+
+int record_entry(uint8_t i, rec_entry_t *entry)
+{
+    uint8_t *ptr = (uint8_t *) entry;
+    uint16_t crc = 0;
+    unsigned int n;
+
+    at45_read_start_at(layout_record_base(), rec_offset(i));
+    for (n = 0; n < sizeof(rec_entry_t); n++) {
+        ptr[n] = at45_spi_read();
+        if (n < offsetof(rec_entry_t, crc16))
+            crc = crc16_byte(crc, ptr[n]);
+    }
+    at45_read_stop();
+
+    if (entry->magic[0] != 'r' || entry->magic[1] != 'c' ||
+        crc != entry->crc16 || entry->start >= record_ring_pages())
+        return -1;
+    return 0;
+}
+
+/* Ranges of ring pages [a, a + an) and [b, b + bn) intersect */
+static int rec_overlap(uint16_t a, uint16_t an, uint16_t b, uint16_t bn)
+{
+    uint16_t ring = record_ring_pages();
+
+    return (b + ring - a) % ring < an || (a + ring - b) % ring < bn;
+}
+
+static void rec_program()
+{
+    at45_buffer_program(rec.buf, rec.ring + rec.page);
+    rec.buf ^= 1;
+    rec.col = 0;
+    rec.pages++;
+    if (++rec.page == rec.ring_pages)
+        rec.page = 0;
+}
+
+/* Copy samples into the AT45 buffers, -1 once the ring is full */
+static int rec_store(const uint8_t *data, uint8_t len)
+{
+    while (len) {
+        uint16_t n = at45_page_size() - rec.col;
+
+        if (rec.pages == rec.ring_pages)
+            return -1;
+        if (n > len)
+            n = len;
+
+        at45_buffer_write(rec.buf, rec.col, data, n);
+        data += n;
+        len -= n;
+        rec.col += n;
+        rec.length += n;
+        if (rec.col == at45_page_size())
+            rec_program();
+    }
+    return 0;
+}
+
+/* New entry into its slot, entries it overwrote are cleared */
+static void rec_catalog_write(rec_entry_t *entry)
+{
+    uint8_t zero[sizeof(rec_entry_t)];
+    uint16_t catalog = layout_record_base();
+    uint8_t i, n = record_entries();
+    uint16_t pages = rec_pages(entry->length);
+    rec_entry_t e;
+
+    memset(zero, 0, sizeof(zero));
+    at45_page_to_buffer(0, catalog);
+    for (i = 0; i < n; i++) {
+        if (!record_entry(i, &e) &&
+            rec_overlap(entry->start, pages, e.start, rec_pages(e.length)))
+            at45_buffer_write(0, rec_offset(i), zero, sizeof(zero));
+    }
+    at45_buffer_write(0, rec_offset(entry->seq % n),
+                      (const uint8_t *) entry, sizeof(rec_entry_t));
+    at45_buffer_program(0, catalog);
+    at45_wait_ready();
+}
+
+int record_run(tick_t max, int (*stop)(void), rec_entry_t *entry)
+{
+    uint8_t *ptr = (uint8_t *) entry;
+    uint8_t i, n = record_entries();
+    uint16_t seq = 0, start = 0;
+    uint16_t crc = 0;
+    uint8_t chunk = 0;
+    rec_entry_t e;
+
+    if (!record_claimed())
+        return -1;
+
+    /* continue after the newest recording */
+    for (i = 0; i < n; i++) {
+        if (!record_entry(i, &e) && e.seq >= seq) {
+            seq = e.seq;
+            start = (e.start + rec_pages(e.length)) % record_ring_pages();
+        }
+    }
+
+    rec.ring = layout_record_base() + 1;
+    rec.ring_pages = record_ring_pages();
+    rec.page = start;
+    rec.col = 0;
+    rec.pages = 0;
+    rec.buf = 0;
+    rec.length = 0;
+
+    rec_full[0] = rec_full[1] = 0;
+    rec_cur = 0;
+    rec_pos = 0;
+    rec_dropped = 0;
+
+    timer_start_oneshot(TIMER_RECORD, max);
+    hal_adc_start(REC_ADC_CHANNEL);
+    _delay_us(REC_ADC_FIRST_US);
+    hal_adc_convert();
+    hal_timer2_ctc(REC_PERIOD);
+
+    while (!timer_read_event(TIMER_RECORD) && !(stop && stop())) {
+        if (!rec_full[chunk])
+            continue;
+        if (rec_store((const uint8_t *) rec_buf[chunk], REC_CHUNK))
+            break;
+        rec_full[chunk] = 0;
+        chunk ^= 1;
+    }
+
+    hal_timer2_ctc_stop();
+    hal_adc_stop();
+    timer_stop(TIMER_RECORD);
+
+    /* full chunks in order, then the one the vector was filling */
+    for (i = 0; i < 2 && rec_full[chunk]; i++) {
+        rec_store((const uint8_t *) rec_buf[chunk], REC_CHUNK);
+        rec_full[chunk] = 0;
+        chunk ^= 1;
+    }
+    rec_store((const uint8_t *) rec_buf[rec_cur], rec_pos);
+    if (rec.col)
+        rec_program();
+    at45_wait_ready();
+
+    entry->magic[0] = 'r';
+    entry->magic[1] = 'c';
+    entry->seq = seq + 1;
+    entry->start = start;
+    entry->length = rec.length;
+    entry->rate = REC_RATE;
+    entry->dropped = rec_dropped;
+    for (i = 0; i < offsetof(rec_entry_t, crc16); i++)
+        crc = crc16_byte(crc, ptr[i]);
+    entry->crc16 = crc;
+
+    rec_catalog_write(entry);
+    return 0;
+}
+
+static uint16_t rec_area_crc(const rec_area_t *area)
+{
+    const uint8_t *ptr = (const uint8_t *) area;
+    uint16_t crc = 0;
+    uint8_t i;
+
+    for (i = 0; i < offsetof(rec_area_t, crc16); i++)
+        crc = crc16_byte(crc, ptr[i]);
+    return crc;
+}
+
+int record_claimed()
+{
+    rec_area_t area;
+    uint8_t *ptr = (uint8_t *) &area;
+    uint8_t i;
+
+    if (!layout_record_pages())
+        return 0;
+
+    at45_read_start_at(layout_record_base(), 0);
+    for (i = 0; i < sizeof(area); i++)
+        ptr[i] = at45_spi_read();
+    at45_read_stop();
+
+    return area.magic[0] == 'r' && area.magic[1] == 'a' &&
+        area.pages == layout_record_pages() &&
+        area.crc16 == rec_area_crc(&area);
+}
+
+/* Empty catalog behind the header, programmed from buffer 1 */
+static void rec_catalog_init(const rec_area_t *area)
+{
+    uint8_t erased[sizeof(rec_entry_t)];
+    uint8_t i, n = record_entries();
+
+    memset(erased, 0xff, sizeof(erased));
+    at45_buffer_write(0, 0, (const uint8_t *) area, sizeof(*area));
+    for (i = 0; i < n; i++)
+        at45_buffer_write(0, rec_offset(i), erased, sizeof(erased));
+    at45_buffer_program(0, layout_record_base());
+    at45_wait_ready();
+}
+
+int record_clear()
+{
+    if (!record_claimed())
+        return -1;
+    return record_claim();
+}
+
+int record_claim()
+{
+    rec_area_t area;
+
+    if (!layout_record_pages())
+        return -1;
+
+    memset(&area, 0, sizeof(area));
+    area.magic[0] = 'r';
+    area.magic[1] = 'a';
+    area.pages = layout_record_pages();
+    area.crc16 = rec_area_crc(&area);
+    rec_catalog_init(&area);
+    return 0;
+}
@@ -0,0 +1,88 @@
+#ifndef DISCONNECT_RECORD_H
+#define DISCONNECT_RECORD_H
+#include <stdint.h>
+
+#include "timer.h"
+
+/*
+ * Microphone recordings in the recording area of the AT45, see
+ * layout_record_base(). The Timer2 compare vector stores an ADC sample
+ * every REC_PERIOD + 1 cycles into one of two REC_CHUNK byte chunks and
+ * starts the next conversion. The main loop copies full chunks into one
+ * of the two AT45 buffers and programs it once the page is full, then
+ * fills the other buffer, so programming a page overlaps capturing the
+ * next one. Samples are unsigned 8-bit at REC_RATE.
+ *
+ * The first page of the area is a catalog of 16-byte entries, the rest
+ * a ring of pages. A recording starts after the newest one, entries of
+ * recordings it overwrites are cleared when the catalog is updated,
+ * once, at the end of the recording.
+ *
+ * The area is the end of slot B, where an image loaded by firmware
+ * without recordings may still be. The first catalog entry is an area
+ * header written by record_claim() once slot B is known to end before
+ * the area (loader.py claims it after writing slot B); nothing is
+ * recorded or cleared in an unclaimed area.
+ */
+#define REC_RATE            8000
+#define REC_PERIOD          (F_CPU / REC_RATE - 1)
+#define REC_CHUNK           64
+#define REC_ADC_CHANNEL     0 /* PF0 */
+/* First conversion takes 25 ADC clocks instead of 13 */
+#define REC_ADC_FIRST_US    100
+/* Longest reply recorded during a call */
+#define REC_MAX             (HZ * 30)
+
+/* Timer id used while recording */
+#define TIMER_RECORD        5
+
+typedef struct {
+    uint8_t magic[2];       /* rc */
+    uint16_t seq;           /* highest is the newest */
+    uint16_t start;         /* first page, relative to the ring */
+    uint32_t length;        /* samples */
+    uint16_t rate;          /* Hz */
+    uint16_t dropped;       /* samples lost, main loop fell behind */
+    uint16_t crc16;         /* of the fields above */
+} __attribute__((packed)) rec_entry_t;
+
+typedef struct {
+    uint8_t magic[2];       /* ra */
+    uint16_t pages;         /* layout_record_pages() when claimed */
+    uint8_t reserved[10];
+    uint16_t crc16;         /* of the fields above */
+} __attribute__((packed)) rec_area_t;
+
+/**
+ * Record until max ticks passed, the ring is full or stop() returns
+ * nonzero, stop may be NULL. The catalog entry written is returned in
+ * entry. Returns -1 without recording if the area isn't claimed.
+ */
+int record_run(tick_t max, int (*stop)(void), rec_entry_t *entry);
+
+/**
+ * Catalog entry i, returns 0 if it is valid.
+ */
+int record_entry(uint8_t i, rec_entry_t *entry);
+
+/* Catalog entries and pages of the ring */
+uint8_t record_entries();
+uint16_t record_ring_pages();
+
+/**
+ * Forget all recordings, -1 if the area isn't claimed.
+ */
+int record_clear();
+
+/**
+ * The area header is valid for this flash.
+ */
+int record_claimed();
+
+/**
+ * Write the area header and an empty catalog, only when slot B is
+ * known to leave the area free. -1 if there is no area.
+ */
+int record_claim();
+
+#endif /* DISCONNECT_RECORD_H */
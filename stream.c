@@ -0,0 +1,124 @@
+#include <avr/io.h>
+#include <avr/interrupt.h>
+
+#include "hal.h"
+#include "adpcm.h"
+#include "stream.h"
+#include "timer.h"
+#include "uart.h"
+
+#define PCM_MASK (STREAM_PCM_SIZE - 1)
+#define BUF_MASK (STREAM_BUF_SIZE - 1)
+
+static volatile uint8_t pcm[STREAM_PCM_SIZE];
+static volatile uint8_t pcm_head; /* next free, main loop */
+static volatile uint8_t pcm_tail; /* next to play, vector */
+static volatile uint8_t stream_playing;
+static volatile uint8_t stream_starved;
+
+SIGNAL(SIG_OUTPUT_COMPARE1A)
+{
+    uint8_t tail = pcm_tail;
+
+    if (!stream_playing)
+        return;
+
+    if (tail == pcm_head) {
+        /* hold the last level until the buffer has refilled */
+        stream_playing = 0;
+        stream_starved = 1;
+        return;
+    }
+
+    hal_dac_write(pcm[tail]);
+    pcm_tail = (tail + 1) & PCM_MASK;
+}
+
+static inline
+uint8_t pcm_fill()
+{
+    return (pcm_head - pcm_tail) & PCM_MASK;
+}
+
+static void stream_report(uint16_t fill, uint16_t underruns)
+{
+    uart0_puts("fill ");
+    uart0_print_hex16(fill);
+    uart0_putc(' ');
+    uart0_print_hex16(underruns);
+    uart0_puts("\r\n");
+}
+
+void stream_play(uint16_t period, stream_stats_t *stats)
+{
+    uint8_t buf[STREAM_BUF_SIZE];
+    uint16_t head = 0, len = 0;
+    adpcm_state_t adpcm = ADPCM_STATE_INIT;
+    unsigned int overflow = uart0_rx_overflow;
+    uint8_t draining = 0;
+    uint8_t full = 0;
+    uint8_t c;
+
+    stats->underruns = 0;
+    stats->overruns = 0;
+    stats->max_fill = 0;
+    pcm_head = pcm_tail = 0;
+    stream_playing = 0;
+    stream_starved = 0;
+
+    timer_start_oneshot(TIMER_STREAM_IDLE, STREAM_IDLE);
+    timer_start_periodic(TIMER_STREAM_REPORT, STREAM_REPORT);
+    hal_timer1_ctc(period);
+
+    while (1) {
+        if (len < STREAM_BUF_SIZE && uart0_getc(&c)) {
+            buf[(head + len) & BUF_MASK] = c;
+            len++;
+            timer_start_oneshot(TIMER_STREAM_IDLE, STREAM_IDLE);
+            /* running dry is an underrun only if more data follows */
+            if (stream_starved) {
+                stream_starved = 0;
+                stats->underruns++;
+            }
+            if (len > stats->max_fill)
+                stats->max_fill = len;
+            if (len == STREAM_BUF_SIZE && !full) {
+                full = 1;
+                stats->overruns++;
+            }
+        } else if (len < STREAM_BUF_SIZE - UART_BUF_SIZE) {
+            full = 0;
+        }
+
+        /* both nibbles of a byte go in at once */
+        if (len && pcm_fill() < STREAM_PCM_SIZE - 2) {
+            uint8_t b = buf[head];
+            uint8_t h = pcm_head;
+
+            head = (head + 1) & BUF_MASK;
+            len--;
+            pcm[h] = adpcm_decode(&adpcm, b >> 4);
+            pcm[(h + 1) & PCM_MASK] = adpcm_decode(&adpcm, b & 0xf);
+            pcm_head = (h + 2) & PCM_MASK;
+        }
+
+        if (timer_read_event(TIMER_STREAM_IDLE))
+            draining = 1;
+
+        if (!stream_playing) {
+            if (draining && !len && !pcm_fill())
+                break;
+            if (len >= STREAM_PREFILL || draining)
+                stream_playing = 1;
+        }
+
+        if (timer_read_event(TIMER_STREAM_REPORT))
+            stream_report(len, stats->underruns);
+    }
+
+    hal_timer1_ctc_stop();
+    timer_stop(TIMER_STREAM_REPORT);
+    hal_dac_write(0x80);
+
+    stats->lost = uart0_rx_overflow - overflow;
+}
@@ -0,0 +1,43 @@
+#ifndef DISCONNECT_STREAM_H
+#define DISCONNECT_STREAM_H
+#include <stdint.h>
+
+/*
+ * Live audio from the UART, see the loader `stream' command. Bytes are
+ * IMA ADPCM (adpcm.h), two samples each, and go into a jitter buffer on
+ * the stack of stream_play(). The main loop decodes ahead into a small
+ * PCM FIFO that the Timer1 compare vector drains to the DAC every
+ * period + 1 CPU cycles.
+ *
+ * The jitter buffer holds STREAM_BUF_SIZE * 2 samples; output starts
+ * once STREAM_PREFILL bytes are buffered and again after an underrun.
+ * A full buffer stops reading the UART, RTS then holds the sender off.
+ * The stream ends when no byte arrived for STREAM_IDLE ticks.
+ */
+#define STREAM_BUF_SIZE     1024 /* power of two */
+#define STREAM_PREFILL      (STREAM_BUF_SIZE / 2)
+#define STREAM_PCM_SIZE     32   /* power of two, up to 256 */
+#define STREAM_IDLE         HZ
+#define STREAM_REPORT       (HZ / 4)
+
+/* 8 kHz, the decoder can't keep up with much more at 1 MHz */
+#define STREAM_PERIOD_MIN   (F_CPU / 8000 - 1)
+
+/* Timer ids used while streaming */
+#define TIMER_STREAM_IDLE   3
+#define TIMER_STREAM_REPORT 4
+
+typedef struct {
+    uint16_t underruns;     /* ran empty while playing, more data came */
+    uint16_t overruns;      /* jitter buffer filled up */
+    uint16_t lost;          /* bytes the UART receive buffer dropped */
+    uint16_t max_fill;      /* jitter buffer high water mark */
+} stream_stats_t;
+
+/**
+ * Play until the sender goes quiet. Sends `fill <bytes> <underruns>'
+ * lines every STREAM_REPORT ticks while playing.
+ */
+void stream_play(uint16_t period, stream_stats_t *stats);
+
+#endif /* DISCONNECT_STREAM_H */
@@ -0,0 +1,117 @@
+#include <stddef.h> /* offsetof */
+#include <string.h>
+#include <avr/io.h>
+#include <avr/eeprom.h>
+
+#include "irq.h"
+#include "crc16.h"
+#include "telemetry.h"
+
+telemetry_record_t telemetry;
+
+static telemetry_record_t telemetry_ee[TELEMETRY_RECORDS]
+    __attribute__((section(".telemetry")));
+
+/* Commit being written */
+static telemetry_record_t telemetry_out;
+static uint8_t telemetry_slot;      /* record of the ring it goes to */
+static uint8_t telemetry_pos = sizeof(telemetry_record_t);
+
+static uint16_t telemetry_crc(const telemetry_record_t *record)
+{
+    const uint8_t *ptr = (const uint8_t *) record;
+    uint16_t crc = 0;
+    uint8_t i;
+
+    for (i = 0; i < offsetof(telemetry_record_t, crc16); i++)
+        crc = crc16_byte(crc, ptr[i]);
+    return crc;
+}
+
+void telemetry_init()
+{
+    uint8_t i, found = 0;
+
+    telemetry_slot = TELEMETRY_RECORDS - 1;
+    memset(&telemetry, 0, sizeof(telemetry));
+
+    /* sequence numbers in the ring are close, compare them mod 2^16 */
+    for (i = 0; i < TELEMETRY_RECORDS; i++) {
+        eeprom_read_block(&telemetry_out, &telemetry_ee[i],
+                          sizeof(telemetry_out));
+        if (telemetry_crc(&telemetry_out) != telemetry_out.crc16)
+            continue;
+        if (found && (int16_t) (telemetry_out.seq - telemetry.seq) <= 0)
+            continue;
+        telemetry = telemetry_out;
+        telemetry_slot = i;
+        found = 1;
+    }
+
+    telemetry_count(TELEMETRY_BOOTS);
+}
+
+void telemetry_add(uint8_t counter, uint16_t n)
+{
+    uint16_t c = telemetry.counter[counter];
+
+    telemetry.counter[counter] = c > 0xffff - n ? 0xffff : c + n;
+}
+
+void telemetry_event(uint8_t id, uint8_t arg)
+{
+    telemetry_event_t *event;
+
+    event = &telemetry.event[telemetry.events++ & (TELEMETRY_EVENTS - 1)];
+    event->id = id;
+    event->arg = arg;
+    event->call = telemetry.counter[TELEMETRY_CALLS];
+}
+
+void telemetry_commit()
+{
+    telemetry.seq++;
+    telemetry.crc16 = telemetry_crc(&telemetry);
+    telemetry_out = telemetry;
+
+    if (telemetry_pos == sizeof(telemetry_record_t) &&
+        ++telemetry_slot == TELEMETRY_RECORDS)
+        telemetry_slot = 0;
+    telemetry_pos = 0;
+}
+
+uint8_t telemetry_idle()
+{
+    uint8_t *ee = (uint8_t *) &telemetry_ee[telemetry_slot];
+    unsigned char flags;
+
+    if (telemetry_pos == sizeof(telemetry_record_t))
+        return 0;
+    if (!eeprom_is_ready())
+        return 1;
+
+    /* EEMWE to EEWE within four cycles, no interrupt in between */
+    local_irq_save(flags);
+    eeprom_update_byte(ee + telemetry_pos,
+                       ((uint8_t *) &telemetry_out)[telemetry_pos]);
+    local_irq_restore(flags);
+
+    return ++telemetry_pos != sizeof(telemetry_record_t);
+}
+
+void telemetry_flush()
+{
+    while (telemetry_idle())
+        ;
+    eeprom_busy_wait();
+}
+
+void telemetry_reset()
+{
+    uint16_t seq = telemetry.seq;
+
+    memset(&telemetry, 0, sizeof(telemetry));
+    telemetry.seq = seq;
+    telemetry_commit();
+    telemetry_flush();
+}
@@ -0,0 +1,106 @@
+#ifndef DISCONNECT_TELEMETRY_H
+#define DISCONNECT_TELEMETRY_H
+#include <stdint.h>
+
+/*
+ * Call counters and a short event log, kept in SRAM and saved to the
+ * EEPROM once a call is over. The EEPROM area is a ring of
+ * TELEMETRY_RECORDS records, each commit writes the next one, the valid
+ * record with the highest sequence number is loaded at boot. A record
+ * torn by a reset fails its CRC and the previous one is used.
+ *
+ * The area is the .telemetry section, linked at a fixed EEPROM address
+ * after fwupdate_request (see Makefile), so it survives firmware
+ * updates. Nothing here runs while audio plays: counting only touches
+ * SRAM, and telemetry_idle() writes one byte each time the main loop
+ * wakes up waiting for the next call, 64 bytes take about 3 s.
+ */
+#define TELEMETRY_RECORDS   60
+#define TELEMETRY_EVENTS    8 /* power of two */
+
+enum telemetry_counter {
+    TELEMETRY_BOOTS,
+    TELEMETRY_CALLS,            /* incoming calls rung */
+    TELEMETRY_ANSWERED,
+    TELEMETRY_IGNORED,          /* rang out, handset never lifted */
+    TELEMETRY_PICKUPS,          /* handset lifted between calls */
+    TELEMETRY_MESSAGES,         /* message played to the end */
+    TELEMETRY_HANGUPS,          /* hung up during the message */
+    TELEMETRY_RECORDINGS,
+    TELEMETRY_REC_DROPPED,      /* samples lost while recording */
+    TELEMETRY_UNDERRUNS,        /* loader stream underruns */
+    TELEMETRY_SLOT_ERRORS,      /* image slot failed its checks */
+    TELEMETRY_COUNTERS,
+};
+
+enum telemetry_event_id {
+    TELEMETRY_EV_NONE,
+    TELEMETRY_EV_HANGUP,        /* arg: percent of the message played */
+    TELEMETRY_EV_SLOT,          /* arg: slot that failed */
+    TELEMETRY_EV_REC_DROPPED,   /* arg: samples dropped, 255 for more */
+    TELEMETRY_EV_UNDERRUN,      /* arg: stream underruns, 255 for more */
+};
+
+typedef struct {
+    uint8_t id;
+    uint8_t arg;
+    uint16_t call;          /* TELEMETRY_CALLS when it happened */
+} __attribute__((packed)) telemetry_event_t;
+
+typedef struct {
+    uint16_t seq;           /* highest is the newest */
+    uint16_t counter[TELEMETRY_COUNTERS];
+    uint8_t events;         /* logged so far, wraps */
+    uint8_t reserved[5];    /* pads the record to 64 bytes */
+    telemetry_event_t event[TELEMETRY_EVENTS];
+    uint16_t crc16;         /* of the fields above */
+} __attribute__((packed)) telemetry_record_t;
+
+/* Counters and events since the last reset */
+extern telemetry_record_t telemetry;
+
+/**
+ * Load the newest valid record and count the boot.
+ */
+void telemetry_init();
+
+/**
+ * Add n to a counter, saturates at 0xffff.
+ */
+void telemetry_add(uint8_t counter, uint16_t n);
+
+static inline
+void telemetry_count(uint8_t counter)
+{
+    telemetry_add(counter, 1);
+}
+
+/**
+ * Log an event, the oldest of TELEMETRY_EVENTS is overwritten.
+ */
+void telemetry_event(uint8_t id, uint8_t arg);
+
+/**
+ * Snapshot the counters for telemetry_idle() to write into the next
+ * record of the ring. A commit still being written is restarted with
+ * the new snapshot in the same record.
+ */
+void telemetry_commit();
+
+/**
+ * Write the next byte of a commit if the EEPROM is ready, doesn't
+ * wait. Returns nonzero while bytes are left.
+ */
+uint8_t telemetry_idle();
+
+/**
+ * Finish the commit in progress, blocking.
+ */
+void telemetry_flush();
+
+/**
+ * Clear counters and events and save that right away, blocking.
+ */
+void telemetry_reset();
+
+#endif /* DISCONNECT_TELEMETRY_H */
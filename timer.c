@@ -4,8 +4,21 @@
 #include "timer.h"
 #include "irq.h"
 
-#define TIMER0_PRESCALE 1024
-#define OCR0_VALUE (((F_CPU / TIMER0_PRESCALE) / HZ) - 1)
+/*
+ * TIMER_ASYNC: Timer0 runs from a 32768Hz watch crystal on TOSC1/TOSC2
+ * and keeps ticking in power-save mode, see standby() in power.h
+ */
+#if TIMER_ASYNC
+# define TIMER0_CLOCK    32768
+# define TIMER0_PRESCALE 8
+# define TIMER0_CS       2
+#else
+# define TIMER0_CLOCK    F_CPU
+# define TIMER0_PRESCALE 1024
+# define TIMER0_CS       7
+#endif
+
+#define OCR0_VALUE (((TIMER0_CLOCK / TIMER0_PRESCALE) / HZ) - 1)
 
 #if (OCR0_VALUE > 255) || (OCR0_VALUE < 0)
 # error "Incorrect INTERRUPT_FREQUENCY"
@@ -31,14 +44,58 @@ void timer_init(void)
     local_irq_save(flags);
     timer_stop_all();
     ticks = 0;
+#if TIMER_ASYNC
+    TIMSK &= ~_BV(OCIE0);
+    ASSR = (1 << AS0);
+#else
     ASSR = 0;
+#endif
     OCR0 = OCR0_VALUE;
+    TCNT0 = 0;
+    TCCR0 = (TIMER0_CS << CS00) | (1 << WGM01);
+#if TIMER_ASYNC
+    while (ASSR & ((1 << TCN0UB) | (1 << OCR0UB) | (1 << TCR0UB)))
+        ;
+#endif
     TIFR = 0;
-    TCCR0 = (7 << CS00) | (1 << WGM01);
     TIMSK = _BV(OCIE0);
     local_irq_restore(flags);
 }
 
+/*
+ * Timer0 clock select for TIMER0_PRESCALE / div, keeps OCR0 and thus HZ
+ * valid while the system clock is divided by div (see clock.c)
+ */
+void timer_clock_div(unsigned char div)
+{
+#if TIMER_ASYNC
+    /* crystal clock does not go through XDIV */
+    (void) div;
+#else
+    unsigned char cs;
+
+    switch (div) {
+    case 4:
+        cs = 6; /* 256 */
+        break;
+    case 8:
+        cs = 5; /* 128 */
+        break;
+    case 32:
+        cs = 3; /* 32 */
+        break;
+    case 128:
+        cs = 2; /* 8 */
+        break;
+    default:
+        cs = TIMER0_CS;
+        break;
+    }
+
+    TCCR0 = (cs << CS00) | (1 << WGM01);
+#endif
+}
+
 void timer_enable()
 {
     TIMSK |= _BV(OCIE0);
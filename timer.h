@@ -5,6 +5,10 @@
 # define HZ 124 /* 0.117065556712 error after 1-hour running at 8Mhz */
 #endif
 
+#ifndef TIMER_ASYNC
+# define TIMER_ASYNC 0 /* Timer0 on a 32768Hz crystal, see timer.c */
+#endif
+
 #define TIMER_ID_MAX 8
 
 enum timer_mode {
@@ -37,6 +41,7 @@ void timer_stop(timer_id_t id);
 void timer_stop_all();
 enum timer_mode timer_get_mode(timer_id_t id);
 
+void timer_clock_div(unsigned char div);
 void timer_enable();
 void timer_disable();
 
@@ -0,0 +1,73 @@
+#include "trace.h"
+#include "uart.h"
+
+/*
+ * Frame on the wire: TRACE_SYNC, trace_event_t, 8-bit sum of the event.
+ * tracedump.py decodes it.
+ */
+#define TRACE_SYNC 0xa5
+#define TRACE_FRAME_SIZE (sizeof(trace_event_t) + 2)
+
+trace_event_t trace_ring[TRACE_SIZE];
+volatile uint8_t trace_head;
+volatile uint8_t trace_len;
+volatile uint16_t trace_lost;
+
+/* Pop oldest event, a pending loss count is reported first */
+static uint8_t trace_pop(uint8_t *frame)
+{
+    trace_event_t *event = (trace_event_t *) (frame + 1);
+    unsigned char flags;
+    uint8_t sum = 0;
+    uint8_t i;
+
+    local_irq_save(flags);
+    if (trace_lost) {
+        event->id = TRACE_LOST;
+        event->sub = hal_timer0_count();
+        event->ticks = ticks;
+        event->arg[0] = trace_lost;
+        event->arg[1] = 0;
+        trace_lost = 0;
+    } else if (trace_len) {
+        *event = trace_ring[(trace_head - trace_len) & (TRACE_SIZE - 1)];
+        trace_len--;
+    } else {
+        local_irq_restore(flags);
+        return 0;
+    }
+    local_irq_restore(flags);
+
+    frame[0] = TRACE_SYNC;
+    for (i = 0; i < sizeof(trace_event_t); i++)
+        sum += frame[i + 1];
+    frame[TRACE_FRAME_SIZE - 1] = sum;
+
+    return 1;
+}
+
+uint8_t trace_drain()
+{
+    uint8_t frame[TRACE_FRAME_SIZE];
+
+    while (trace_len || trace_lost) {
+        if (uart0_tx_free() < TRACE_FRAME_SIZE)
+            break;
+        if (!trace_pop(frame))
+            break;
+        uart0_write(frame, TRACE_FRAME_SIZE);
+    }
+
+    return trace_len;
+}
+
+void trace_flush()
+{
+    uint8_t frame[TRACE_FRAME_SIZE];
+    uint8_t i;
+
+    while (trace_pop(frame)) {
+        for (i = 0; i < TRACE_FRAME_SIZE; i++)
+            uart0_putc(frame[i]);
+    }
+}
@@ -0,0 +1,80 @@
+/* Binary event tracing */
+#ifndef DISCONNECT_TRACE_H
+#define DISCONNECT_TRACE_H
+#include <stdint.h>
+#include <avr/io.h>
+
+#include "hal.h"
+#include "irq.h"
+#include "timer.h"
+
+/*
+ * Event ids. The comment holds the format string, tracedump.py reads it
+ * from this file, the firmware never sees it. Append only.
+ */
+enum trace_id {
+    TRACE_NONE = 0,
+    TRACE_BOOT,             /* "running phone, slot at page %u" */
+    TRACE_LOST,             /* "%u events lost" */
+    TRACE_SLEEP,            /* "sleeping for at least %u ticks" */
+    TRACE_CALL_INCOMING,    /* "incoming call" */
+    TRACE_CALL_BUSY,        /* "service busy message" */
+    TRACE_CALL_ZOOM,        /* "busy tone" */
+    TRACE_PLAY,             /* "played sample at page %u, hung up %u" */
+    TRACE_PANIC,            /* "panic %u" */
+    TRACE_WAKE,             /* "first ring %u.%03u ms after wakeup" */
+    TRACE_HOOK_AUDIO,       /* "first audio %u us after hook-off" */
+    TRACE_RECORD,           /* "recorded reply %u, %u samples dropped" */
+    TRACE_TELEMETRY,        /* "telemetry record %u saved after %u calls" */
+    TRACE_MAX,
+} ;
+
+#define TRACE_SIZE 32 /* events, power of two */
+
+typedef struct {
+    uint8_t id;
+    uint8_t sub;            /* TCNT0, fraction of a tick */
+    uint16_t ticks;
+    uint16_t arg[2];
+} __attribute__((packed)) trace_event_t;
+
+extern trace_event_t trace_ring[TRACE_SIZE];
+extern volatile uint8_t trace_head;
+extern volatile uint8_t trace_len;
+extern volatile uint16_t trace_lost;
+
+/* Record event, oldest one is overwritten when the ring is full */
+static inline
+void trace(uint8_t id, uint16_t a, uint16_t b)
+{
+    trace_event_t *event;
+    unsigned char flags;
+
+    local_irq_save(flags);
+    event = &trace_ring[trace_head];
+    trace_head = (trace_head + 1) & (TRACE_SIZE - 1);
+    if (trace_len < TRACE_SIZE)
+        trace_len++;
+    else
+        trace_lost++;
+
+    event->id = id;
+    event->sub = hal_timer0_count();
+    event->ticks = ticks;
+    event->arg[0] = a;
+    event->arg[1] = b;
+    local_irq_restore(flags);
+}
+
+/**
+ * Send as many events as fit into the UART transmit buffer without
+ * waiting. Returns number of events still queued.
+ */
+uint8_t trace_drain();
+
+/**
+ * Send all events, blocking.
+ */
+void trace_flush();
+
+#endif /* DISCONNECT_TRACE_H */
@@ -0,0 +1,208 @@
+"""Decode binary trace events sent by the firmware, see trace.h"""
+import os
+import re
+import struct
+import sys
+
+HZ = 20
+F_CPU = 1000000
+TIMER0_PRESCALER = 1024
+
+# TIMER_ASYNC builds, Timer0 on a watch crystal
+TOSC = 32768
+TOSC_PRESCALER = 8
+
+TRACE_SYNC = 0xa5
+EVENT_FORMAT = '<BBHHH'
+EVENT_SIZE = struct.calcsize(EVENT_FORMAT)
+FRAME_SIZE = EVENT_SIZE + 2
+
+TRACE_H = os.path.join(os.path.dirname(os.path.abspath(__file__)), 'trace.h')
+
+
+class TraceError(Exception):
+    pass
+
+
+def load_formats(fname=TRACE_H):
+    """Event id -> (name, format string), from the trace_id enum"""
+    with open(fname) as fp:
+        text = fp.read()
+
+    m = re.search(r'enum trace_id {(.*?)}', text, re.S)
+    if not m:
+        raise TraceError, '%s: no trace_id enum' % fname
+
+    formats = {}
+    entry = re.compile(r'^\s*(TRACE_\w+)\s*(?:=\s*(\d+))?,\s*'
+                       r'(?:/\*\s*"(.*)"\s*\*/)?')
+    next_id = 0
+    for line in m.group(1).splitlines():
+        e = entry.match(line)
+        if not e:
+            continue
+        name, value, fmt = e.groups()
+        if value is not None:
+            next_id = int(value)
+        formats[next_id] = (name, fmt or name)
+        next_id += 1
+    return formats
+
+
+class Event(object):
+    def __init__(self, data, formats):
+        self.id, self.sub, self.ticks, a, b = \
+            struct.unpack(EVENT_FORMAT, data)
+        self.args = (a, b)
+        self.name, self.fmt = formats.get(self.id,
+                                          ('TRACE_%d' % self.id,
+                                           'unknown event %d' % self.id))
+
+    def time(self, hz=HZ, sub_unit=float(TIMER0_PRESCALER) / F_CPU):
+        """Seconds since the tick counter wrapped
+
+        sub_unit is the duration of one Timer0 count.
+        """
+        return float(self.ticks) / hz + self.sub * sub_unit
+
+    def message(self):
+        nargs = self.fmt.count('%') - 2 * self.fmt.count('%%')
+        return self.fmt % self.args[:nargs]
+
+
+class Decoder(object):
+    """Splits a byte stream into events, resyncs on bad frames"""
+
+    def __init__(self, formats=None):
+        self.formats = formats or load_formats()
+        self.buf = ''
+        self.errors = 0
+
+    def feed(self, data):
+        self.buf += data
+        events = []
+
+        while len(self.buf) >= FRAME_SIZE:
+            if ord(self.buf[0]) != TRACE_SYNC:
+                self.skip()
+                continue
+
+            body = self.buf[1:1 + EVENT_SIZE]
+            if sum(map(ord, body)) & 0xff != ord(self.buf[FRAME_SIZE - 1]):
+                self.skip()
+                continue
+
+            events.append(Event(body, self.formats))
+            self.buf = self.buf[FRAME_SIZE:]
+
+        return events
+
+    def skip(self):
+        pos = self.buf.find(chr(TRACE_SYNC), 1)
+        if pos < 0:
+            pos = len(self.buf)
+        self.buf = self.buf[pos:]
+        self.errors += 1
+
+
+class Histogram(object):
+    """Power-of-two buckets of one event's first argument, 0xffff is
+    taken as saturated and counted apart"""
+
+    def __init__(self, name, unit):
+        self.name = name
+        self.unit = unit
+        self.buckets = {}
+        self.saturated = 0
+
+    def add(self, event):
+        if event.name != self.name:
+            return
+        value = event.args[0]
+        if value == 0xffff:
+            self.saturated += 1
+            return
+        bucket = 0
+        while (1 << bucket) <= value:
+            bucket += 1
+        self.buckets[bucket] = self.buckets.get(bucket, 0) + 1
+
+    def write(self, out):
+        total = sum(self.buckets.values()) + self.saturated
+        out.write('%s: %d samples\n' % (self.name, total))
+        if self.saturated:
+            out.write('  %d at 65535 %s or more\n' % (self.saturated,
+                                                     self.unit))
+        if total == self.saturated:
+            return
+        for bucket in xrange(max(self.buckets) + 1):
+            count = self.buckets.get(bucket, 0)
+            low = bucket and 1 << (bucket - 1)
+            out.write('  %6d - %6d %s %6d %s\n' % (
+                low, (1 << bucket) - 1, self.unit, count,
+                '#' * (count * 50 / total)))
+
+
+def dump(fp, out, hz=HZ, sub_unit=float(TIMER0_PRESCALER) / F_CPU,
+         histograms=()):
+    decoder = Decoder()
+
+    try:
+        while True:
+            data = fp.read(FRAME_SIZE)
+            if not data:
+                break
+            for event in decoder.feed(data):
+                out.write('%10.4f %-20s %s\n' % (event.time(hz, sub_unit),
+                                                event.name, event.message()))
+                out.flush()
+                for h in histograms:
+                    h.add(event)
+    except KeyboardInterrupt:
+        pass
+
+    if decoder.errors:
+        out.write('%d resyncs\n' % decoder.errors)
+    for h in histograms:
+        h.write(out)
+
+
+if __name__ == "__main__":
+    from optparse import OptionParser
+
+    parser = OptionParser(usage='%prog [options] <device|file>')
+    parser.add_option("--hz", dest="hz", type="int", default=HZ,
+                      help="Timer tick rate [%default]")
+    parser.add_option("--f-cpu", dest="f_cpu", type="int", default=F_CPU,
+                      help="CPU clock [%default]")
+    parser.add_option("--async", dest="timer_async", default=False,
+                      action="store_true",
+                      help="Firmware built with TIMER_ASYNC=1")
+    parser.add_option("--latency", dest="latency", default=False,
+                      action="store_true",
+                      help="Print hook-off to audio latency histogram "
+                      "at the end")
+
+    (options, args) = parser.parse_args()
+
+    if len(args) != 1:
+        parser.error('need a serial device or a capture file')
+
+    if os.path.exists(args[0]) and not os.path.isfile(args[0]):
+        import serial
+        fp = serial.Serial(args[0], 57600, bytesize=8,
+                           parity=serial.PARITY_NONE, stopbits=2,
+                           timeout=None)
+    else:
+        fp = open(args[0], 'rb')
+
+    if options.timer_async:
+        sub_unit = float(TOSC_PRESCALER) / TOSC
+    else:
+        sub_unit = float(TIMER0_PRESCALER) / options.f_cpu
+
+    histograms = []
+    if options.latency:
+        histograms.append(Histogram('TRACE_HOOK_AUDIO', 'us'))
+
+    dump(fp, sys.stdout, options.hz, sub_unit, histograms)
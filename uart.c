@@ -2,12 +2,32 @@
 
 #include "uart.h"
 
+#define TX_MASK (UART_TX_BUF_SIZE - 1)
+
+static volatile unsigned char _uart0_tx_buf[UART_TX_BUF_SIZE];
+static volatile unsigned char _uart0_tx_head; /* next free */
+static volatile unsigned char _uart0_tx_tail; /* next to send */
+static volatile unsigned char _uart0_tx_sent;  /* TXC is meaningful */
+volatile unsigned int uart0_tx_dropped;
+volatile unsigned int uart0_rx_overrun;
+volatile unsigned int uart0_rx_frame_err;
+volatile unsigned int uart0_rx_overflow;
+
 void uart0_init(unsigned int baud)
 {
     unsigned char cfg;
 
     cfg = (unsigned char) (1 << RXEN) | (1 << TXEN) | (1 << RXCIE0);
 
+    _uart0_tx_head = _uart0_tx_tail = 0;
+    _uart0_tx_sent = 0;
+    _uart0_buf_len = 0;
+
+#if UART_FLOW_RTS
+    UART_RTS_DDR |= (1 << UART_RTS_BIT);
+#endif
+    uart0_rts(1);
+
     /* Set baud rate */
     UBRR0H = (unsigned char) (baud >> 8);
     UBRR0L = (unsigned char) (baud & 0xff);
@@ -22,9 +42,12 @@ void uart0_init(unsigned int baud)
 
 void uart0_reset()
 {
+    uart0_flush();
+
     /* disable uart */
     UCSR0B = 0;
     UCSR0A = 0;
+    uart0_rts(0);
 }
 
 volatile char _uart0_buf[UART_BUF_SIZE];
@@ -33,8 +56,130 @@ volatile unsigned char _uart0_buf_len = 0;
 
 SIGNAL(SIG_UART0_RECV)
 {
-    _uart0_buf[_uart0_buf_pos] = UDR0;
+    /* error flags are only valid before UDR0 is read */
+    unsigned char status = hal_uart_status();
+    unsigned char c = hal_uart_read();
+
+    if (status & (1 << DOR))
+        uart0_rx_overrun++;
+
+    if (status & (1 << FE)) {
+        uart0_rx_frame_err++;
+        return;
+    }
+
+    /* keep what is buffered, drop the new byte */
+    if (_uart0_buf_len >= UART_BUF_SIZE) {
+        uart0_rx_overflow++;
+        return;
+    }
+
+    _uart0_buf[_uart0_buf_pos] = c;
     _uart0_buf_pos = (_uart0_buf_pos + 1) & (UART_BUF_SIZE - 1);
-    if (_uart0_buf_len < UART_BUF_SIZE)
-        _uart0_buf_len++;
+    _uart0_buf_len++;
+    if (_uart0_buf_len == UART_RX_HIGH)
+        uart0_rts(0);
+}
+
+/* Send one queued byte by polling, interrupts must be disabled */
+static void uart0_tx_poll()
+{
+    if (_uart0_tx_head == _uart0_tx_tail)
+        return;
+
+    while (!(hal_uart_status() & (1 << UDRE)))
+        ;
+    hal_uart_txc_clear();
+    hal_uart_write(_uart0_tx_buf[_uart0_tx_tail]);
+    _uart0_tx_sent = 1;
+    _uart0_tx_tail = (_uart0_tx_tail + 1) & TX_MASK;
+}
+
+static unsigned char uart0_tx_put(unsigned char c)
+{
+    unsigned char flags;
+    unsigned char next;
+
+    local_irq_save(flags);
+    next = (_uart0_tx_head + 1) & TX_MASK;
+    if (next == _uart0_tx_tail) {
+        local_irq_restore(flags);
+        return 0;
+    }
+    _uart0_tx_buf[_uart0_tx_head] = c;
+    _uart0_tx_head = next;
+    UCSR0B |= (1 << UDRIE0);
+    local_irq_restore(flags);
+
+    return 1;
+}
+
+void uart0_putc(unsigned char c)
+{
+#if UART_TX_POLICY == UART_TX_BLOCK
+    while (!uart0_tx_put(c)) {
+        if (!(SREG & (1 << SREG_I)))
+            uart0_tx_poll();
+    }
+#else
+    if (!uart0_tx_put(c)) {
+# if UART_TX_POLICY == UART_TX_COUNT
+        uart0_tx_dropped++;
+# endif
+    }
+#endif
+}
+
+unsigned int uart0_write(const void *buf, unsigned int len)
+{
+    const unsigned char *ptr = buf;
+    unsigned int i;
+
+    for (i = 0; i < len; i++) {
+        if (!uart0_tx_put(ptr[i]))
+            break;
+    }
+
+    return i;
+}
+
+unsigned char uart0_tx_free()
+{
+    return TX_MASK - ((_uart0_tx_head - _uart0_tx_tail) & TX_MASK);
+}
+
+unsigned char uart0_tx_idle()
+{
+    if (_uart0_tx_head != _uart0_tx_tail)
+        return 0;
+    /* TXC is cleared on every UDR0 write */
+    return !_uart0_tx_sent || (hal_uart_status() & (1 << TXC));
+}
+
+void uart0_flush()
+{
+    if (!(UCSR0B & (1 << TXEN)))
+        return;
+
+    while (_uart0_tx_head != _uart0_tx_tail) {
+        if (!(SREG & (1 << SREG_I)))
+            uart0_tx_poll();
+    }
+
+    /* TXC is cleared on every UDR0 write */
+    while (_uart0_tx_sent && !(hal_uart_status() & (1 << TXC)))
+        ;
+}
+
+SIGNAL(SIG_UART0_DATA)
+{
+    if (_uart0_tx_head == _uart0_tx_tail) {
+        UCSR0B &= ~(1 << UDRIE0);
+        return;
+    }
+
+    hal_uart_txc_clear();
+    hal_uart_write(_uart0_tx_buf[_uart0_tx_tail]);
+    _uart0_tx_sent = 1;
+    _uart0_tx_tail = (_uart0_tx_tail + 1) & TX_MASK;
 }
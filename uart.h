@@ -3,26 +3,90 @@
 
 #define UART_BAUD(b) (((F_CPU) / (8 * (b))) - 1)
 #define UART_BUF_SIZE 64
+#define UART_TX_BUF_SIZE 128 /* power of two, up to 256 */
+
+/* What uart0_putc() does when the transmit buffer is full */
+#define UART_TX_BLOCK 0 /* wait for space */
+#define UART_TX_DROP  1 /* discard byte */
+#define UART_TX_COUNT 2 /* discard byte, count it in uart0_tx_dropped */
+
+#ifndef UART_TX_POLICY
+# define UART_TX_POLICY UART_TX_BLOCK
+#endif
+
+/*
+ * Receive flow control: RTS (active low) is released when the receive
+ * buffer fills up to UART_RX_HIGH and asserted again once it drains to
+ * UART_RX_LOW. The slack covers bytes USB adapters still send after
+ * RTS goes away. XON/XOFF is not an option, page data is binary.
+ */
+#ifndef UART_FLOW_RTS
+# define UART_FLOW_RTS 1
+#endif
+
+#define UART_RTS_DDR  DDRD
+#define UART_RTS_BIT  PD4 /* see hal_rts() */
+
+#define UART_RX_HIGH (UART_BUF_SIZE - 16)
+#define UART_RX_LOW  16
 
 #include <avr/io.h>
 
+#include "hal.h"
 #include "irq.h"
 
 void uart0_init(unsigned int baud);
 void uart0_reset();
 
-static inline
-void uart0_putc(unsigned char c)
-{
-    while ( !(UCSR0A & (1<<UDRE)) )
-        ;
-    UDR0 = c;
-}
+/**
+ * Queue byte for transmission, drained by the UDRE interrupt.
+ * Full buffer is handled according to UART_TX_POLICY, with interrupts
+ * disabled the blocking policy drains the buffer by polling.
+ */
+void uart0_putc(unsigned char c);
+
+/**
+ * Queue as much of buf as fits without waiting.
+ * Returns number of bytes queued.
+ */
+unsigned int uart0_write(const void *buf, unsigned int len);
+
+/**
+ * Free space in the transmit buffer.
+ */
+unsigned char uart0_tx_free();
+
+/**
+ * Nonzero when nothing is queued or being shifted out.
+ */
+unsigned char uart0_tx_idle();
+
+/**
+ * Wait until all queued bytes have left the transmitter.
+ */
+void uart0_flush();
+
+extern volatile unsigned int uart0_tx_dropped;
+
+/* Receive errors: hardware overrun, bad stop bit, buffer full */
+extern volatile unsigned int uart0_rx_overrun;
+extern volatile unsigned int uart0_rx_frame_err;
+extern volatile unsigned int uart0_rx_overflow;
 
 extern volatile char _uart0_buf[UART_BUF_SIZE];
 extern volatile unsigned char _uart0_buf_pos;
 extern volatile unsigned char _uart0_buf_len;
 
+static inline
+void uart0_rts(unsigned char ready)
+{
+#if UART_FLOW_RTS
+    hal_rts(!ready);
+#else
+    (void) ready;
+#endif
+}
+
 static inline
 unsigned char uart0_getc(unsigned char *c)
 {
@@ -37,6 +101,8 @@ unsigned char uart0_getc(unsigned char *c)
 
     *c = _uart0_buf[(_uart0_buf_pos - _uart0_buf_len) & (UART_BUF_SIZE - 1)];
     _uart0_buf_len--;
+    if (_uart0_buf_len == UART_RX_LOW)
+        uart0_rts(1);
     local_irq_restore(flags);
     return 1;
 }
@@ -44,9 +110,9 @@ unsigned char uart0_getc(unsigned char *c)
 static inline
 unsigned char uart0_getc_noi(unsigned char *c)
 {
-    if ( !(UCSR0A & (1<<RXC)))
+    if ( !(hal_uart_status() & (1<<RXC)))
         return 0;
-    *c = UDR0;
+    *c = hal_uart_read();
     return 1;
 }
 